@@ -1,6 +1,8 @@
 #include "cl.h"
+#include "libscsan.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 int init_opencl_context(OpenCLContext *ctx) {
@@ -36,6 +38,128 @@ void clean_opencl_context(OpenCLContext *ctx) {
   memset(ctx, 0, sizeof(OpenCLContext));
 }
 
+int get_env_bytes(const char *name, size_t fallback, size_t *bytes) {
+  const char *value = getenv(name);
+
+  *bytes = fallback;
+
+  if (!value || !*value) {
+    return 0;
+  }
+
+  char *end;
+  unsigned long long parsed = strtoull(value, &end, 10);
+
+  switch (*end) {
+  case 'G':
+    parsed <<= 10;
+    // fall through
+  case 'M':
+    parsed <<= 10;
+    // fall through
+  case 'K':
+    parsed <<= 10;
+    ++end;
+    break;
+  default:
+    break;
+  }
+
+  if (*end != '\0' || parsed == 0) {
+    fprintf(stderr, "Invalid %s: %s\n", name, value);
+
+    return -1;
+  }
+
+  *bytes = (size_t)parsed;
+
+  return 0;
+}
+
+int add_kernel_svm_pointer(OpenCLContext *ctx, void *pointer) {
+  if (ctx->num_svm_pointers == MAX_KERNEL_SVM_POINTERS) {
+    fprintf(stderr, "Too many shared virtual memory pointers for the kernel\n");
+
+    return -1;
+  }
+
+  ctx->svm_pointers[ctx->num_svm_pointers++] = pointer;
+
+  const cl_int err = clSetKernelExecInfo(
+      ctx->kernel, CL_KERNEL_EXEC_INFO_SVM_PTRS,
+      sizeof(void *) * ctx->num_svm_pointers, ctx->svm_pointers);
+  CHECK_CL_ERROR(err, "Error in passing shared virtual memory to the kernel");
+
+  return 0;
+}
+
+static const char *const feature_names[LIBSCSAN_FEATURE_COUNT] = {
+    [LIBSCSAN_FEATURE_BOUNDS] = "bounds",
+    [LIBSCSAN_FEATURE_LOCAL_RACES] = "local",
+    [LIBSCSAN_FEATURE_REPORTING] = "report",
+    [LIBSCSAN_FEATURE_BARRIERS] = "barrier",
+    [LIBSCSAN_FEATURE_GLOBAL_RACES] = "global",
+};
+
+// Turn sanitizer features on and off through their specialization constants.
+// SCSAN_FEATURES is a comma separated list of feature names, "all" or
+// "none"; every feature stays on when it is not set.
+static int set_sanitizer_features(OpenCLContext *ctx) {
+  const char *value = getenv("SCSAN_FEATURES");
+
+  if (!value) {
+    return 0;
+  }
+
+  cl_int enabled[LIBSCSAN_FEATURE_COUNT] = {0};
+  const char *cursor = value;
+
+  while (*cursor) {
+    const size_t length = strcspn(cursor, ",");
+    int found = 0;
+
+    if (length == 3 && strncmp(cursor, "all", length) == 0) {
+      for (int i = 0; i < LIBSCSAN_FEATURE_COUNT; ++i) {
+        enabled[i] = 1;
+      }
+
+      found = 1;
+    } else if (length == 4 && strncmp(cursor, "none", length) == 0) {
+      found = 1;
+    }
+
+    for (int i = 0; i < LIBSCSAN_FEATURE_COUNT && !found; ++i) {
+      if (strlen(feature_names[i]) == length &&
+          strncmp(cursor, feature_names[i], length) == 0) {
+        enabled[i] = 1;
+        found = 1;
+      }
+    }
+
+    if (!found && length > 0) {
+      fprintf(stderr, "Unknown sanitizer feature in SCSAN_FEATURES: %.*s\n",
+              (int)length, cursor);
+
+      return -1;
+    }
+
+    cursor += length;
+    cursor += *cursor == ',';
+  }
+
+  for (int i = 0; i < LIBSCSAN_FEATURE_COUNT; ++i) {
+    const cl_int err = clSetProgramSpecializationConstant(
+        ctx->program, LIBSCSAN_SPEC_ID_BASE + i, sizeof(cl_int), &enabled[i]);
+
+    // Programs without the sanitizer have no such constant
+    if (err != CL_SUCCESS && err != CL_INVALID_SPEC_ID) {
+      CL_ERROR(err, "Error in setting sanitizer specialization constant");
+    }
+  }
+
+  return 0;
+}
+
 int load_spv_program(OpenCLContext *ctx, const char *path,
                      const char *kernel_name) {
   cl_int err;
@@ -100,6 +224,10 @@ int load_spv_program(OpenCLContext *ctx, const char *path,
   free(il);
   CHECK_CL_ERROR(err, "Error in creating program");
 
+  if (set_sanitizer_features(ctx) != 0) {
+    return -1;
+  }
+
   err = clBuildProgram(ctx->program, 0, NULL, NULL, NULL, NULL);
   if (err != CL_SUCCESS) {
     size_t log_size;
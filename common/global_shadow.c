@@ -0,0 +1,150 @@
+#include "global_shadow.h"
+#include "libscsan.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Point the runtime at the table with the current epoch (0: detector off) and
+// warn about the writes the previous dispatch could not record
+static int set_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow) {
+  cl_int err;
+  const cl_uint mask = shadow->slots - 1;
+
+  err = clSetKernelArgSVMPointer(shadow->kernel, 0, shadow->table);
+  CHECK_CL_ERROR(err, "Error in setting global shadow kernel argument table");
+
+  err = clSetKernelArg(shadow->kernel, 1, sizeof(cl_uint), &mask);
+  CHECK_CL_ERROR(err, "Error in setting global shadow kernel argument mask");
+
+  err = clSetKernelArg(shadow->kernel, 2, sizeof(cl_uint), &shadow->epoch);
+  CHECK_CL_ERROR(err, "Error in setting global shadow kernel argument epoch");
+
+  err = clSetKernelArg(shadow->kernel, 3, sizeof(cl_mem), &shadow->d_dropped);
+  CHECK_CL_ERROR(err, "Error in setting global shadow kernel argument dropped");
+
+  const size_t global_size = 1;
+
+  err = clEnqueueNDRangeKernel(ctx->queue, shadow->kernel, 1, NULL,
+                               &global_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in enqueueing global shadow kernel");
+
+  cl_uint dropped;
+
+  err = clEnqueueReadBuffer(ctx->queue, shadow->d_dropped, CL_TRUE, 0,
+                            sizeof(cl_uint), &dropped, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in reading dropped global shadow writes");
+
+  if (dropped) {
+    fprintf(stderr,
+            "[ComputeSanitizer] %u global memory writes were not checked, "
+            "raise SCSAN_GLOBAL_SHADOW_BYTES\n",
+            dropped);
+  }
+
+  return 0;
+}
+
+static int clear_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow) {
+  const cl_ulong zero = 0;
+
+  const cl_int err = clEnqueueSVMMemFill(
+      ctx->queue, shadow->table, &zero, sizeof(zero),
+      sizeof(cl_ulong) * shadow->slots, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in clearing global shadow table");
+
+  return 0;
+}
+
+int init_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow) {
+  cl_int err;
+
+  shadow->kernel =
+      clCreateKernel(ctx->program, LIBSCSAN_SET_GLOBAL_SHADOW_KERNEL, &err);
+
+  if (err == CL_INVALID_KERNEL_NAME) {
+    // Runtime without the global race detector
+    shadow->kernel = NULL;
+
+    return 0;
+  }
+  CHECK_CL_ERROR(err, "Error in creating global shadow kernel");
+
+  size_t budget;
+
+  if (get_env_bytes("SCSAN_GLOBAL_SHADOW_BYTES", LIBSCSAN_GLOBAL_SHADOW_BYTES,
+                    &budget) != 0) {
+    return -1;
+  }
+
+  // Largest power of two number of slots within the budget
+  shadow->slots = LIBSCSAN_GLOBAL_SHADOW_PROBES;
+
+  while (shadow->slots < (1u << 31) &&
+         (size_t)shadow->slots * 2 * sizeof(cl_ulong) <= budget) {
+    shadow->slots *= 2;
+  }
+
+  shadow->table = clSVMAlloc(ctx->context, CL_MEM_READ_WRITE,
+                             sizeof(cl_ulong) * shadow->slots, 0);
+
+  if (!shadow->table) {
+    fprintf(stderr, "Failed to allocate the global shadow table (%zu bytes) "
+                    "in shared virtual memory\n",
+            sizeof(cl_ulong) * shadow->slots);
+
+    return -1;
+  }
+
+  shadow->d_dropped = clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY,
+                                     sizeof(cl_uint), NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating dropped global shadow write buffer");
+
+  // The sanitized kernel only reaches the table through the runtime
+  if (add_kernel_svm_pointer(ctx, shadow->table) != 0) {
+    return -1;
+  }
+
+  if (clear_global_shadow(ctx, shadow) != 0) {
+    return -1;
+  }
+
+  return next_global_shadow_epoch(ctx, shadow);
+}
+
+int next_global_shadow_epoch(OpenCLContext *ctx, GlobalShadow *shadow) {
+  if (!shadow->kernel) {
+    return 0;
+  }
+
+  if (shadow->epoch == LIBSCSAN_GLOBAL_SHADOW_MAX_EPOCH) {
+    // Slots of the old epoch 1 would look current again
+    if (clear_global_shadow(ctx, shadow) != 0) {
+      return -1;
+    }
+
+    shadow->epoch = 0;
+  }
+
+  ++shadow->epoch;
+
+  return set_global_shadow(ctx, shadow);
+}
+
+void clean_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow) {
+  if (shadow->kernel && shadow->table && shadow->d_dropped) {
+    // Turn the detector off and collect the last dispatch's dropped writes
+    shadow->epoch = 0;
+
+    set_global_shadow(ctx, shadow);
+    clFinish(ctx->queue);
+  }
+
+  if (shadow->table)
+    clSVMFree(ctx->context, shadow->table);
+  if (shadow->d_dropped)
+    clReleaseMemObject(shadow->d_dropped);
+  if (shadow->kernel)
+    clReleaseKernel(shadow->kernel);
+
+  memset(shadow, 0, sizeof(GlobalShadow));
+}
@@ -15,12 +15,17 @@
     }                                                                          \
   } while (0)
 
+// Shared virtual memory the runtime reaches through program scope variables
+#define MAX_KERNEL_SVM_POINTERS 4
+
 typedef struct {
   cl_context context;
   cl_command_queue queue;
   cl_program program;
   cl_kernel kernel;
   cl_device_id device;
+  void *svm_pointers[MAX_KERNEL_SVM_POINTERS];
+  cl_uint num_svm_pointers;
 } OpenCLContext;
 
 int init_opencl_context(OpenCLContext *ctx);
@@ -29,3 +34,12 @@ void clean_opencl_context(OpenCLContext *ctx);
 
 int load_spv_program(OpenCLContext *ctx, const char *path,
                      const char *kernel_name);
+
+// Size in bytes from the environment variable name, with K, M and G suffixes
+// allowed, or fallback when it is not set
+int get_env_bytes(const char *name, size_t fallback, size_t *bytes);
+
+// Let ctx->kernel access the shared virtual memory at pointer although no
+// argument points to it. Every call replaces the whole list the kernel has,
+// so all such pointers must go through here.
+int add_kernel_svm_pointer(OpenCLContext *ctx, void *pointer);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "cl.h"
+
+typedef struct {
+  cl_kernel kernel; // NULL if the runtime has no global race detector
+  void *table;      // Shared virtual memory, 8 bytes per slot
+  cl_uint slots;
+  cl_uint epoch;
+  cl_mem d_dropped;
+} GlobalShadow;
+
+// Allocate the hashed shadow table of the global memory race detector for
+// ctx->kernel and start the first dispatch epoch. The budget in bytes comes
+// from the SCSAN_GLOBAL_SHADOW_BYTES environment variable (K, M and G
+// suffixes allowed), not from the size of the buffers. Does nothing when the
+// runtime was built without LIBSCSAN_GLOBAL_RACES.
+int init_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow);
+
+// Start a new dispatch epoch. Call it before enqueueing ctx->kernel again, so
+// that writes of the earlier dispatches no longer conflict.
+int next_global_shadow_epoch(OpenCLContext *ctx, GlobalShadow *shadow);
+
+void clean_global_shadow(OpenCLContext *ctx, GlobalShadow *shadow);
@@ -0,0 +1,127 @@
+#pragma once
+
+// Data shared between the sanitizer runtime (OpenCL C) and the host.
+// Layouts must not depend on which side includes this header.
+
+#ifdef __OPENCL_C_VERSION__
+#define LIBSCSAN_U32 uint
+#define LIBSCSAN_U64 ulong
+#else
+#include <CL/cl.h>
+
+#define LIBSCSAN_U32 cl_uint
+#define LIBSCSAN_U64 cl_ulong
+#endif
+
+// Number of records kept by the device ring buffer
+#define LIBSCSAN_REPORT_CAPACITY 512
+
+// Size of the per-site report counter table. Site ids are folded into it.
+#define LIBSCSAN_MAX_SITES 1024
+
+// Reports materialized per site, later ones are only counted
+#ifndef LIBSCSAN_REPORTS_PER_SITE
+#define LIBSCSAN_REPORTS_PER_SITE 8
+#endif
+
+// Kernel in the runtime that copies the ring buffer and the site counters out
+// and resets them
+#define LIBSCSAN_READ_REPORTS_KERNEL "libscsan_read_reports"
+
+// Sanitizer features that can be turned off at program build time. Each one
+// is backed by the SPIR-V specialization constant LIBSCSAN_SPEC_ID_BASE +
+// feature, a 32-bit int defaulting to 1 (enabled).
+enum {
+  LIBSCSAN_FEATURE_BOUNDS = 0,
+  LIBSCSAN_FEATURE_LOCAL_RACES = 1,
+  LIBSCSAN_FEATURE_REPORTING = 2,
+  LIBSCSAN_FEATURE_BARRIERS = 3,
+  LIBSCSAN_FEATURE_GLOBAL_RACES = 4,
+  LIBSCSAN_FEATURE_COUNT,
+};
+
+#define LIBSCSAN_SPEC_ID_BASE 0x5c5a0000u
+
+#ifdef __OPENCL_C_VERSION__
+uint libscsan_feature_enabled(uint feature);
+#endif
+
+// Sample rates are fractions of LIBSCSAN_SAMPLE_SCALE work-groups
+#define LIBSCSAN_SAMPLE_SCALE 65536
+
+// Initial sample rate of the runtime (every work-group)
+#ifndef LIBSCSAN_SAMPLE_RATE
+#define LIBSCSAN_SAMPLE_RATE LIBSCSAN_SAMPLE_SCALE
+#endif
+
+// Kernel in the runtime that sets the sample rate
+#define LIBSCSAN_SET_SAMPLE_RATE_KERNEL "libscsan_set_sample_rate"
+
+// Global memory race detection, in runtimes built with LIBSCSAN_GLOBAL_RACES.
+// Writes are recorded in an open-addressed table of 64-bit slots
+// [key:24 | epoch:8 | phase:8 | group:12 | local:12] the host allocates in
+// shared virtual memory. The key is a hash of the address granule, the epoch
+// counts dispatches (0: detector off), the phase counts the global memory
+// barriers the writer passed, and group and local are the linear ids of the
+// writer's work-group and of the writer within it.
+
+// Default table budget in bytes
+#ifndef LIBSCSAN_GLOBAL_SHADOW_BYTES
+#define LIBSCSAN_GLOBAL_SHADOW_BYTES (64ul << 20)
+#endif
+
+// Slots probed for a granule before the write goes unchecked
+#define LIBSCSAN_GLOBAL_SHADOW_PROBES 8
+
+#define LIBSCSAN_GLOBAL_SHADOW_MAX_EPOCH 0xffu
+
+// The fields are folded into their bits, which costs some precision:
+// - Work-groups whose linear ids agree modulo 1 << GROUP_BITS count as one,
+//   so their writes may be taken for a single writer or ordered by barriers
+//   and go unreported. Likewise for local ids modulo 1 << LOCAL_BITS.
+// - A slot that outlives 256 global memory barriers of its work-group looks
+//   like the current phase again, and a later write of the group conflicts.
+// - Granules whose keys collide in 24 bits within the probed slots are taken
+//   for one granule, and writes of two work-items to them conflict.
+#define LIBSCSAN_GLOBAL_SHADOW_MAX_PHASE 0xffu
+#define LIBSCSAN_GLOBAL_SHADOW_GROUP_BITS 12
+#define LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS 12
+#define LIBSCSAN_GLOBAL_SHADOW_WRITER_MASK 0xffffffu // group:12 | local:12
+
+// Kernel in the runtime that installs the table and the dispatch epoch
+#define LIBSCSAN_SET_GLOBAL_SHADOW_KERNEL "libscsan_set_global_shadow"
+
+// Shadows the compiler spilled out of local memory (-scsan-local-mem-budget)
+// live in per-work-group slices of a buffer the host allocates in shared
+// virtual memory. Work-groups whose slice lies beyond the buffer leave their
+// spilled shadows unchecked.
+
+// Default buffer size in bytes (0: spilled shadows are not checked)
+#ifndef LIBSCSAN_SHADOW_SPILL_BYTES
+#define LIBSCSAN_SHADOW_SPILL_BYTES 0ul
+#endif
+
+// Kernel in the runtime that installs the buffer
+#define LIBSCSAN_SET_SHADOW_SPILL_KERNEL "libscsan_set_shadow_spill"
+
+enum {
+  LIBSCSAN_REPORT_INDEX_OUT_OF_BOUNDS = 1,
+  LIBSCSAN_REPORT_LOCAL_MEMORY_CONFLICT = 2,
+  LIBSCSAN_REPORT_DIVERGENT_BARRIER = 3,
+  LIBSCSAN_REPORT_GLOBAL_MEMORY_CONFLICT = 4,
+};
+
+// conflict_id of a cell read by several work-items
+#define LIBSCSAN_CONFLICT_SHARED_READERS (~(LIBSCSAN_U64)0)
+
+typedef struct {
+  LIBSCSAN_U32 kind; // LIBSCSAN_REPORT_*
+  LIBSCSAN_U32 site; // Check site id, 0 if unknown
+  LIBSCSAN_U64 global_id[3];
+  LIBSCSAN_U64 local_id[3];
+  // Local id of the previous accessor of the cell, the previous writer of a
+  // global granule as (work-group linear id << 32 | local linear id), both
+  // folded as in its slot, or for a divergent barrier the number of
+  // work-items that reached it
+  LIBSCSAN_U64 conflict_id;
+} libscsan_report_record;
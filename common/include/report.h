@@ -0,0 +1,20 @@
+#pragma once
+
+#include "cl.h"
+#include "libscsan.h"
+
+typedef struct {
+  cl_kernel kernel; // NULL if the program has no sanitizer runtime
+  cl_mem d_records;
+  cl_mem d_count;
+  cl_mem d_site_counts;
+  cl_mem d_poisoned;
+  libscsan_report_record h_records[LIBSCSAN_REPORT_CAPACITY];
+  cl_uint h_site_counts[LIBSCSAN_MAX_SITES];
+} ReportBuffer;
+
+int init_report_buffer(OpenCLContext *ctx, ReportBuffer *reports);
+
+void clean_report_buffer(ReportBuffer *reports);
+
+int read_reports(OpenCLContext *ctx, ReportBuffer *reports);
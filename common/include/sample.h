@@ -0,0 +1,12 @@
+#pragma once
+
+#include "cl.h"
+
+// Set the fraction (0.0 - 1.0) of work-groups the sanitizer checks. Only
+// kernels built with -scsan-sample-work-groups look at it. Does nothing when
+// the program has no sanitizer runtime.
+int set_sample_rate(OpenCLContext *ctx, double rate);
+
+// Apply the sample rate from the SCSAN_SAMPLE_RATE environment variable, if
+// set
+int init_sample_rate(OpenCLContext *ctx);
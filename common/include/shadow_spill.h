@@ -0,0 +1,19 @@
+#pragma once
+
+#include "cl.h"
+
+typedef struct {
+  cl_kernel kernel; // NULL if the runtime cannot spill shadows
+  void *buffer;     // Shared virtual memory, NULL when not allocated
+  size_t capacity;
+  cl_mem d_needed;
+} ShadowSpill;
+
+// Allocate the buffer that holds the shadows the compiler spilled out of
+// local memory for ctx->kernel. Its size in bytes comes from the
+// SCSAN_SHADOW_SPILL_BYTES environment variable (K, M and G suffixes
+// allowed); without it spilled shadows stay unchecked and
+// clean_shadow_spill tells how much they needed.
+int init_shadow_spill(OpenCLContext *ctx, ShadowSpill *spill);
+
+void clean_shadow_spill(OpenCLContext *ctx, ShadowSpill *spill);
@@ -0,0 +1,204 @@
+#include "report.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// ANSI colors
+#define RESET "\033[0m"
+#define RED "\033[31m"
+#define YELLOW "\033[33m"
+#define BLUE "\033[34m"
+#define BOLD "\033[1m"
+
+int init_report_buffer(OpenCLContext *ctx, ReportBuffer *reports) {
+  cl_int err;
+
+  reports->kernel =
+      clCreateKernel(ctx->program, LIBSCSAN_READ_REPORTS_KERNEL, &err);
+
+  if (err == CL_INVALID_KERNEL_NAME) {
+    // Not linked with the sanitizer runtime, nothing to read
+    reports->kernel = NULL;
+
+    return 0;
+  }
+  CHECK_CL_ERROR(err, "Error in creating report kernel");
+
+  reports->d_records = clCreateBuffer(
+      ctx->context, CL_MEM_WRITE_ONLY,
+      sizeof(libscsan_report_record) * LIBSCSAN_REPORT_CAPACITY, NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating report buffer");
+
+  reports->d_count = clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY,
+                                    sizeof(cl_uint), NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating report count buffer");
+
+  reports->d_site_counts =
+      clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY,
+                     sizeof(cl_uint) * LIBSCSAN_MAX_SITES, NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating site count buffer");
+
+  reports->d_poisoned = clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY,
+                                       sizeof(cl_uint), NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating poisoned flag buffer");
+
+  err = clSetKernelArg(reports->kernel, 0, sizeof(cl_mem), &reports->d_records);
+  CHECK_CL_ERROR(err, "Error in setting report kernel argument records");
+
+  err = clSetKernelArg(reports->kernel, 1, sizeof(cl_mem), &reports->d_count);
+  CHECK_CL_ERROR(err, "Error in setting report kernel argument count");
+
+  err = clSetKernelArg(reports->kernel, 2, sizeof(cl_mem),
+                       &reports->d_site_counts);
+  CHECK_CL_ERROR(err, "Error in setting report kernel argument site_counts");
+
+  err =
+      clSetKernelArg(reports->kernel, 3, sizeof(cl_mem), &reports->d_poisoned);
+  CHECK_CL_ERROR(err, "Error in setting report kernel argument poisoned");
+
+  return 0;
+}
+
+void clean_report_buffer(ReportBuffer *reports) {
+  if (reports->kernel)
+    clReleaseKernel(reports->kernel);
+  if (reports->d_records)
+    clReleaseMemObject(reports->d_records);
+  if (reports->d_count)
+    clReleaseMemObject(reports->d_count);
+  if (reports->d_site_counts)
+    clReleaseMemObject(reports->d_site_counts);
+  if (reports->d_poisoned)
+    clReleaseMemObject(reports->d_poisoned);
+
+  memset(reports, 0, sizeof(ReportBuffer));
+}
+
+static void print_report(const libscsan_report_record *record) {
+  printf("\n" BLUE BOLD "==============================================================================="
+         "\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET
+         ": (Global #" YELLOW "(%llu, %llu, %llu)" RESET
+         ", Local #" YELLOW "(%llu, %llu, %llu)" RESET ", Site #" YELLOW
+         "%u" RESET ") ",
+         (unsigned long long)record->global_id[0],
+         (unsigned long long)record->global_id[1],
+         (unsigned long long)record->global_id[2],
+         (unsigned long long)record->local_id[0],
+         (unsigned long long)record->local_id[1],
+         (unsigned long long)record->local_id[2], record->site);
+
+  switch (record->kind) {
+  case LIBSCSAN_REPORT_INDEX_OUT_OF_BOUNDS:
+    printf("Array index out of bounds\n");
+    break;
+  case LIBSCSAN_REPORT_LOCAL_MEMORY_CONFLICT:
+    if (record->conflict_id == LIBSCSAN_CONFLICT_SHARED_READERS) {
+      printf("Local memory conflict detected (Previously read by several "
+             "work-items)\n");
+    } else {
+      printf("Local memory conflict detected (Previously accessed by Local "
+             "#" YELLOW "%llu" RESET ")\n",
+             (unsigned long long)record->conflict_id);
+    }
+    break;
+  case LIBSCSAN_REPORT_GLOBAL_MEMORY_CONFLICT:
+    printf("Global memory conflict detected (Previously written by Local "
+           "#" YELLOW "%u" RESET " of Group #" YELLOW "%u" RESET ")\n",
+           (unsigned)(record->conflict_id & 0xffffffffu),
+           (unsigned)(record->conflict_id >> 32));
+    break;
+  case LIBSCSAN_REPORT_DIVERGENT_BARRIER:
+    printf("Barrier reached by only " YELLOW "%llu" RESET
+           " work-items of the work-group\n",
+           (unsigned long long)record->conflict_id);
+    break;
+  default:
+    printf("Unknown error (kind %u)\n", record->kind);
+    break;
+  }
+}
+
+static void print_site_summary(const ReportBuffer *reports) {
+  int header_printed = 0;
+
+  for (cl_uint site = 0; site < LIBSCSAN_MAX_SITES; ++site) {
+    const cl_uint count = reports->h_site_counts[site];
+
+    if (count == 0) {
+      continue;
+    }
+
+    if (!header_printed) {
+      printf("\n" BLUE "[ComputeSanitizer] " RESET "Errors per site:\n");
+
+      header_printed = 1;
+    }
+
+    printf("  Site #" YELLOW "%u" RESET ": %u errors (%u reported)\n", site,
+           count,
+           count < LIBSCSAN_REPORTS_PER_SITE ? count
+                                             : LIBSCSAN_REPORTS_PER_SITE);
+  }
+}
+
+int read_reports(OpenCLContext *ctx, ReportBuffer *reports) {
+  cl_int err;
+
+  if (!reports->kernel) {
+    return 0;
+  }
+
+  // Copy the device report buffer and site counters out and reset them
+  const size_t global_size = 1;
+
+  err = clEnqueueNDRangeKernel(ctx->queue, reports->kernel, 1, NULL,
+                               &global_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in enqueueing report kernel");
+
+  cl_uint count;
+
+  err = clEnqueueReadBuffer(ctx->queue, reports->d_count, CL_TRUE, 0,
+                            sizeof(cl_uint), &count, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in reading report count");
+
+  err = clEnqueueReadBuffer(ctx->queue, reports->d_site_counts, CL_TRUE, 0,
+                            sizeof(cl_uint) * LIBSCSAN_MAX_SITES,
+                            reports->h_site_counts, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in reading site counts");
+
+  cl_uint poisoned;
+
+  err = clEnqueueReadBuffer(ctx->queue, reports->d_poisoned, CL_TRUE, 0,
+                            sizeof(cl_uint), &poisoned, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in reading poisoned flag");
+
+  const cl_uint size =
+      count < LIBSCSAN_REPORT_CAPACITY ? count : LIBSCSAN_REPORT_CAPACITY;
+
+  if (size > 0) {
+    err = clEnqueueReadBuffer(ctx->queue, reports->d_records, CL_TRUE, 0,
+                              sizeof(libscsan_report_record) * size,
+                              reports->h_records, 0, NULL, NULL);
+    CHECK_CL_ERROR(err, "Error in reading reports");
+  }
+
+  for (cl_uint i = 0; i < size; ++i) {
+    print_report(&reports->h_records[i]);
+  }
+
+  // The device keeps the first records and only counts the ones after
+  if (count > size) {
+    printf("\n[ComputeSanitizer] %u later reports were dropped\n",
+           count - size);
+  }
+
+  print_site_summary(reports);
+
+  if (poisoned) {
+    printf("\n" BLUE "[ComputeSanitizer] " RESET
+           "Aborted after the first error, later work-items did not run to "
+           "completion\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include "sample.h"
+#include "libscsan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int set_sample_rate(OpenCLContext *ctx, double rate) {
+  cl_int err;
+
+  cl_kernel kernel =
+      clCreateKernel(ctx->program, LIBSCSAN_SET_SAMPLE_RATE_KERNEL, &err);
+
+  if (err == CL_INVALID_KERNEL_NAME) {
+    // Not linked with the sanitizer runtime
+    return 0;
+  }
+  CHECK_CL_ERROR(err, "Error in creating sample rate kernel");
+
+  if (rate < 0.0) {
+    rate = 0.0;
+  } else if (rate > 1.0) {
+    rate = 1.0;
+  }
+
+  const cl_uint scaled = (cl_uint)(rate * LIBSCSAN_SAMPLE_SCALE + 0.5);
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_uint), &scaled);
+
+  if (err != CL_SUCCESS) {
+    clReleaseKernel(kernel);
+    CL_ERROR(err, "Error in setting sample rate kernel argument rate");
+  }
+
+  const size_t global_size = 1;
+
+  err = clEnqueueNDRangeKernel(ctx->queue, kernel, 1, NULL, &global_size, NULL,
+                               0, NULL, NULL);
+  clReleaseKernel(kernel);
+  CHECK_CL_ERROR(err, "Error in enqueueing sample rate kernel");
+
+  return 0;
+}
+
+int init_sample_rate(OpenCLContext *ctx) {
+  const char *value = getenv("SCSAN_SAMPLE_RATE");
+
+  if (!value || !*value) {
+    return 0;
+  }
+
+  char *end;
+  const double rate = strtod(value, &end);
+
+  if (*end != '\0') {
+    fprintf(stderr, "Invalid SCSAN_SAMPLE_RATE: %s\n", value);
+
+    return -1;
+  }
+
+  return set_sample_rate(ctx, rate);
+}
@@ -0,0 +1,103 @@
+#include "shadow_spill.h"
+#include "libscsan.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Point the runtime at the buffer and warn when the previous dispatch needed
+// more than it had
+static int set_shadow_spill(OpenCLContext *ctx, ShadowSpill *spill) {
+  cl_int err;
+  const cl_ulong capacity = spill->buffer ? spill->capacity : 0;
+
+  err = clSetKernelArgSVMPointer(spill->kernel, 0, spill->buffer);
+  CHECK_CL_ERROR(err, "Error in setting shadow spill kernel argument base");
+
+  err = clSetKernelArg(spill->kernel, 1, sizeof(cl_ulong), &capacity);
+  CHECK_CL_ERROR(err, "Error in setting shadow spill kernel argument capacity");
+
+  err = clSetKernelArg(spill->kernel, 2, sizeof(cl_mem), &spill->d_needed);
+  CHECK_CL_ERROR(err, "Error in setting shadow spill kernel argument needed");
+
+  const size_t global_size = 1;
+
+  err = clEnqueueNDRangeKernel(ctx->queue, spill->kernel, 1, NULL,
+                               &global_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in enqueueing shadow spill kernel");
+
+  cl_uint needed[2];
+
+  err = clEnqueueReadBuffer(ctx->queue, spill->d_needed, CL_TRUE, 0,
+                            sizeof(needed), needed, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in reading needed shadow spill bytes");
+
+  const cl_ulong bytes = (cl_ulong)needed[0] * needed[1];
+
+  if (bytes > capacity) {
+    fprintf(stderr,
+            "[ComputeSanitizer] Spilled local memory shadows need %llu bytes "
+            "(%u work-groups of %u bytes), set SCSAN_SHADOW_SPILL_BYTES to "
+            "check them all\n",
+            (unsigned long long)bytes, needed[0], needed[1]);
+  }
+
+  return 0;
+}
+
+int init_shadow_spill(OpenCLContext *ctx, ShadowSpill *spill) {
+  cl_int err;
+
+  spill->kernel =
+      clCreateKernel(ctx->program, LIBSCSAN_SET_SHADOW_SPILL_KERNEL, &err);
+
+  if (err == CL_INVALID_KERNEL_NAME) {
+    // Runtime without program scope variables
+    spill->kernel = NULL;
+
+    return 0;
+  }
+  CHECK_CL_ERROR(err, "Error in creating shadow spill kernel");
+
+  if (get_env_bytes("SCSAN_SHADOW_SPILL_BYTES", LIBSCSAN_SHADOW_SPILL_BYTES,
+                    &spill->capacity) != 0) {
+    return -1;
+  }
+
+  if (spill->capacity) {
+    spill->buffer =
+        clSVMAlloc(ctx->context, CL_MEM_READ_WRITE, spill->capacity, 0);
+
+    // Only the spilled shadows go unchecked
+    if (!spill->buffer) {
+      fprintf(stderr,
+              "[ComputeSanitizer] Failed to allocate %zu bytes of shared "
+              "virtual memory for spilled shadows\n",
+              spill->capacity);
+    } else if (add_kernel_svm_pointer(ctx, spill->buffer) != 0) {
+      return -1;
+    }
+  }
+
+  spill->d_needed = clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY,
+                                   2 * sizeof(cl_uint), NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating needed shadow spill buffer");
+
+  return set_shadow_spill(ctx, spill);
+}
+
+void clean_shadow_spill(OpenCLContext *ctx, ShadowSpill *spill) {
+  if (spill->kernel && spill->d_needed) {
+    // Collect what the last dispatch needed
+    set_shadow_spill(ctx, spill);
+    clFinish(ctx->queue);
+  }
+
+  if (spill->buffer)
+    clSVMFree(ctx->context, spill->buffer);
+  if (spill->d_needed)
+    clReleaseMemObject(spill->d_needed);
+  if (spill->kernel)
+    clReleaseKernel(spill->kernel);
+
+  memset(spill, 0, sizeof(ShadowSpill));
+}
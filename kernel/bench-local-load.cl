@@ -0,0 +1,21 @@
+// bench-local-load: ローカルメモリからの読み込みを繰り返すマイクロベンチマーク用カーネルです。
+// 隣のワークアイテムのセルを読むため、読み込みはすべてチェック対象になります。競合は発生しません。
+
+kernel void run(global int* input, global int* output, const uint loads) {
+  volatile local int local_buffer[256];
+
+  int gid = get_global_id(0);
+  int lid = get_local_id(0);
+  int next = (lid + 1) % get_local_size(0);
+  int sum = 0;
+
+  local_buffer[lid] = input[gid];
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint i = 0; i < loads; ++i) {
+    sum += local_buffer[next];
+  }
+
+  output[gid] = sum;
+}
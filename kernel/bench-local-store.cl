@@ -0,0 +1,15 @@
+// bench-local-store: ローカルメモリへのストアを繰り返すマイクロベンチマーク用カーネルです。
+// 各ワークアイテムは自分のセルにだけ書き込むため、競合は発生しません。
+
+kernel void run(global int* input, global int* output, const uint stores) {
+  volatile local int local_buffer[256];
+
+  int gid = get_global_id(0);
+  int lid = get_local_id(0);
+
+  for (uint i = 0; i < stores; ++i) {
+    local_buffer[lid] = input[gid] + i;
+  }
+
+  output[gid] = local_buffer[lid];
+}
@@ -0,0 +1,7 @@
+// ng-global-conflict: 2つのワークアイテムがグローバルメモリの同じ要素に書き込みます。GLOBAL_RACES=1 でビルドすると検出されます。
+
+kernel void run(constant float *a, constant float *b, global float *c) {
+  size_t id = get_global_id(0);
+
+  c[id / 2] = a[id] + b[id]; // :bomb:
+}
@@ -0,0 +1,10 @@
+// ng-out-of-bound-access-helper: サイズを受け取らないヘルパー関数の中で配列のサイズを超えるアクセスを行い、不具合を誘発させます。
+
+float load_shifted(constant float *p, size_t i) {
+  return p[i + 3];
+}
+
+kernel void run(constant float *a, const unsigned long a_size, constant float *b, const unsigned long b_size, global float *c, const unsigned long c_size) {
+  size_t id = get_global_id(0);
+  c[id] = a[id] + load_shifted(b, id);
+}
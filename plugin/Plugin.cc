@@ -1,20 +1,96 @@
+#include <llvm/Config/llvm-config.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
 
 #include "SPIRVComputeSanitizer.h"
 
 namespace llvm {
 
+enum class SanitizerExtensionPoint { PipelineStart, OptimizerLast };
+
+static cl::opt<SanitizerExtensionPoint> ClExtensionPoint(
+    "scsan-extension-point",
+    cl::desc("Where clang runs the sanitizer in the optimization pipeline"),
+    cl::values(clEnumValN(SanitizerExtensionPoint::PipelineStart,
+                          "pipeline-start",
+                          "Before any optimization (default)"),
+               clEnumValN(SanitizerExtensionPoint::OptimizerLast,
+                          "optimizer-last",
+                          "After the optimization pipeline, followed by a "
+                          "small cleanup of the inserted checks")),
+    cl::Hidden, cl::init(SanitizerExtensionPoint::PipelineStart));
+
+// Late instrumentation is not followed by the rest of the pipeline, so the
+// values the checks recompute are merged here
+static void add_sanitizer_passes(ModulePassManager &MPM, bool Late) {
+  MPM.addPass(SPIRVComputeSanitizerPass());
+
+  if (!Late) {
+    return;
+  }
+
+  FunctionPassManager Cleanup;
+  Cleanup.addPass(EarlyCSEPass());
+  Cleanup.addPass(SimplifyCFGPass());
+
+  MPM.addPass(createModuleToFunctionPassAdaptor(std::move(Cleanup)));
+}
+
+static bool parse_sanitizer_pipeline(StringRef Name, ModulePassManager &MPM) {
+  if (!Name.consume_front("spirv-compute-sanitizer")) {
+    return false;
+  }
+
+  if (Name.empty() || Name == "<early>") {
+    add_sanitizer_passes(MPM, false);
+
+    return true;
+  }
+
+  if (Name == "<late>") {
+    add_sanitizer_passes(MPM, true);
+
+    return true;
+  }
+
+  return false;
+}
+
 extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "SPIR-V Compute Sanitizer plugin", "v0.1",
           [](PassBuilder &PB) {
-            PB.registerPipelineStartEPCallback([&](ModulePassManager &MPM,
-                                                   OptimizationLevel) {
-              FunctionPassManager FPM;
-              FPM.addPass(SPIRVComputeSanitizerPass());
-              MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
-            });
+            PB.registerPipelineStartEPCallback(
+                [&](ModulePassManager &MPM, OptimizationLevel) {
+                  if (ClExtensionPoint ==
+                      SanitizerExtensionPoint::PipelineStart) {
+                    add_sanitizer_passes(MPM, false);
+                  }
+                });
+
+            PB.registerOptimizerLastEPCallback(
+                [&](ModulePassManager &MPM, OptimizationLevel Level
+#if LLVM_VERSION_MAJOR >= 20
+                    ,
+                    ThinOrFullLTOPhase
+#endif
+                ) {
+                  if (ClExtensionPoint ==
+                      SanitizerExtensionPoint::OptimizerLast) {
+                    add_sanitizer_passes(MPM,
+                                         Level != OptimizationLevel::O0);
+                  }
+                });
+
+            // opt -passes='spirv-compute-sanitizer<late>'
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  return parse_sanitizer_pipeline(Name, MPM);
+                });
           }};
 }
 
@@ -1,18 +1,234 @@
 #include "SPIRVComputeSanitizer.h"
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/TargetParser/Triple.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
 
 #define DEBUG_TYPE "spirv-compute-sanitizer"
 
 using namespace llvm;
 
+STATISTIC(NumBoundsChecks, "Number of array bounds checks inserted");
+STATISTIC(NumRangeChecks, "Number of byte range bounds checks inserted");
+STATISTIC(NumAddressRangeChecks,
+          "Number of range checks on pointers merged by phis or selects");
+STATISTIC(NumHoistedChecks, "Number of bounds checks hoisted out of loops");
+STATISTIC(NumVersionedLoops,
+          "Number of loops given an unchecked copy behind a range test");
+STATISTIC(NumDominatedChecks,
+          "Number of bounds checks elided by a dominating check");
+STATISTIC(NumMergedChecks, "Number of bounds checks merged into another");
+STATISTIC(NumProvenChecks, "Number of bounds checks proven statically");
+STATISTIC(NumLocalChecks, "Number of local memory race checks inserted");
+STATISTIC(NumOwnElementLoads,
+          "Number of loads of a work-item's own local element left unchecked");
+STATISTIC(NumShadowClaims, "Number of shadow compare-exchange claims emitted");
+STATISTIC(NumShadowStamps, "Number of shadow stamps of private stores emitted");
+STATISTIC(NumShadowBytes, "Number of bytes of local memory used by shadows");
+STATISTIC(NumSpilledShadowBytes,
+          "Number of bytes per work-group of shadows spilled to global memory");
+STATISTIC(NumGlobalWriteChecks, "Number of global memory writes recorded");
+STATISTIC(NumBarrierChecks, "Number of barrier arrival checks inserted");
+STATISTIC(NumUniformBarriers,
+          "Number of barriers proven to be reached by the whole work-group");
+STATISTIC(NumPropagatedSizes,
+          "Number of array sizes passed on to helpers as hidden arguments");
+STATISTIC(NumSkippedFunctions,
+          "Number of functions left alone for having nothing to check");
+STATISTIC(NumPoisonChecks,
+          "Number of abort-on-error polls inserted at entries and back-edges");
+STATISTIC(NumStopChecks,
+          "Number of polls inserted after calls to helpers that may stop");
+
+static cl::opt<bool> ClHoistLoopChecks(
+    "scsan-hoist-loop-checks",
+    cl::desc("Check the whole index range of affine or loop-invariant array "
+             "accesses once in the loop preheader (not in optnone "
+             "functions)"),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClVersionLoops(
+    "scsan-version-loops",
+    cl::desc("Test the index range of every array access of an innermost "
+             "loop once before it, and run an unchecked copy of the loop "
+             "when all of it is in bounds (not in optnone functions)"),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<bool> ClEliminateRedundantChecks(
+    "scsan-eliminate-redundant-checks",
+    cl::desc("Drop bounds checks covered by a dominating check on the same "
+             "array and merge checks of the same block (not in optnone "
+             "functions)"),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClProveInBounds(
+    "scsan-prove-in-bounds",
+    cl::desc("Drop bounds checks whose index is proven smaller than the size "
+             "from reqd_work_group_size, the maximum global size and "
+             "offset, and __builtin_assume (not in optnone functions)"),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<uint64_t> ClMaxGlobalSize(
+    "scsan-max-global-size",
+    cl::desc("Largest global size of any dimension the host launches kernels "
+             "with (0: unknown). Kernels can declare their own in "
+             "!scsan.max_global_size metadata. Only bounds get_global_id "
+             "together with the maximum global offset."),
+    cl::Hidden, cl::init(0));
+
+static cl::opt<int64_t> ClMaxGlobalOffset(
+    "scsan-max-global-offset",
+    cl::desc("Largest global work offset of any dimension the host launches "
+             "kernels with (-1: unknown, 0: always launched without one). "
+             "Kernels can declare their own in !scsan.max_global_offset "
+             "metadata."),
+    cl::Hidden, cl::init(-1));
+
+static cl::opt<bool> ClPropagateArraySizes(
+    "scsan-propagate-array-sizes",
+    cl::desc("Pass the size of a linked array on to helper functions that "
+             "only receive the pointer, as a hidden trailing argument of a "
+             "copy of the helper"),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClCheckBarriers(
+    "scsan-check-barriers",
+    cl::desc("Count the work-items arriving at each barrier not proven to be "
+             "reached by the whole work-group, and report when some are "
+             "missing"),
+    cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClGlobalRaces(
+    "scsan-global-races",
+    cl::desc("Record every global memory store in the runtime's hashed "
+             "shadow table and report writes of another work-item of the "
+             "same dispatch (needs a runtime built with "
+             "LIBSCSAN_GLOBAL_RACES)"),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<unsigned> ClGlobalGranularity(
+    "scsan-global-granularity",
+    cl::desc("Bytes of global memory covered by one shadow table slot, a "
+             "power of two. Narrower stores get slots of their own size."),
+    cl::Hidden, cl::init(4));
+
+enum class ErrorAction { Return, Abort, Recover };
+
+static cl::opt<ErrorAction> ClOnError(
+    "scsan-on-error",
+    cl::desc("What a work-item does after a failed check"),
+    cl::values(clEnumValN(ErrorAction::Return, "return",
+                          "Report and return from the function (default)"),
+               clEnumValN(ErrorAction::Abort, "abort",
+                          "Report, poison the dispatch and return; every "
+                          "function entry and loop back-edge returns once "
+                          "the dispatch is poisoned"),
+               clEnumValN(ErrorAction::Recover, "recover",
+                          "Report and perform the access anyway")),
+    cl::Hidden, cl::init(ErrorAction::Return));
+
+static cl::opt<bool> ClSampleWorkGroups(
+    "scsan-sample-work-groups",
+    cl::desc("Only check the work-groups selected by the runtime sample rate; "
+             "the others run an unchecked copy of the kernel"),
+    cl::Hidden, cl::init(false));
+
+static cl::opt<unsigned> ClMaxWorkGroupSize(
+    "scsan-max-work-group-size",
+    cl::desc("Largest work-group size kernels are launched with, unless "
+             "every kernel declares reqd_work_group_size. Shadow cells are "
+             "16-bit when every local id and a barrier epoch fit, 32-bit "
+             "otherwise"),
+    cl::Hidden, cl::init(1024));
+
+static cl::opt<uint64_t> ClLocalMemBudget(
+    "scsan-local-mem-budget",
+    cl::desc("Bytes of local memory a work-group may use (0: unlimited), "
+             "e.g. CL_DEVICE_LOCAL_MEM_SIZE. Shadows of kernels that would "
+             "exceed it move to a per work-group slice of global memory."),
+    cl::Hidden, cl::init(0));
+
+static cl::opt<unsigned> ClShadowGranularity(
+    "scsan-shadow-granularity",
+    cl::desc("Bytes of a local array covered by one shadow cell (0: one cell "
+             "per array element)"),
+    cl::Hidden, cl::init(0));
+
+// Dominating checks compared against each access, most recent first
+static constexpr unsigned MaxDominatingChecks = 8;
+
+// Operands followed when proving a branch condition uniform
+static constexpr unsigned MaxUniformDepth = 16;
+
+// Barrier epochs are kept per work-item in an unsigned char, and a shadow
+// cell needs room for a few of them next to the owner
+static constexpr unsigned MaxEpochBits = 8;
+static constexpr unsigned MinEpochBits = 4;
+
+// Stores per work-item up to which a kernel with a known work-group size
+// clears its shadows inline instead of calling libscsan_shadow_reset
+static constexpr unsigned MaxUnrolledResetStores = 16;
+
+// Features the host can turn off through specialization constants. Mirrors
+// LIBSCSAN_FEATURE_* in common/include/libscsan.h.
+static constexpr unsigned FeatureBounds = 0;
+static constexpr unsigned FeatureLocalRaces = 1;
+static constexpr unsigned FeatureReporting = 2;
+static constexpr unsigned FeatureBarriers = 3;
+static constexpr unsigned FeatureGlobalRaces = 4;
+
 static constexpr char get_global_id_name[] = "_Z13get_global_idj";
 static constexpr char get_local_id_name[] = "_Z12get_local_idj";
-
+static constexpr char get_local_linear_id_name[] = "_Z19get_local_linear_idv";
+
+// Work-item builtins returning the same value across a work-group
+static constexpr const char *uniform_builtin_names[] = {
+    "_Z12get_group_idj",   "_Z14get_local_sizej",    "_Z15get_global_sizej",
+    "_Z14get_num_groupsj", "_Z17get_global_offsetj", "_Z12get_work_dimv"};
+
+// barrier(), work_group_barrier() and the SPIR-V control barrier
+static constexpr const char *barrier_names[] = {
+    "_Z7barrierj", "_Z18work_group_barrierj",
+    "_Z18work_group_barrierj12memory_scope", "_Z22__spirv_ControlBarrieriii"};
+
+// CLK_GLOBAL_MEM_FENCE, and the CrossWorkgroupMemory bit of SPIR-V memory
+// semantics
+static constexpr uint64_t GlobalMemFence = 0x2;
+static constexpr uint64_t CrossWorkgroupMemory = 0x200;
+
+// CLK_LOCAL_MEM_FENCE, the WorkgroupMemory bit of SPIR-V memory semantics
+// and the SPIR-V Workgroup scope, below which scopes are wider
+static constexpr uint64_t LocalMemFence = 0x1;
+static constexpr uint64_t WorkgroupMemory = 0x100;
+static constexpr uint64_t WorkgroupScope = 2;
+
+static constexpr unsigned GlobalAddressSpace = 1; // SPIR-V global address space
 static constexpr unsigned ConstantAddressSpace =
     2; // SPIR-V constant address space
 static constexpr unsigned LocalAddressSpace = 3; // SPIR-V local address space
@@ -50,64 +266,15 @@ static FunctionCallee insert_fn(Module &M, const StringRef Name, Type *Result,
   return FC;
 }
 
-struct SanitizerFunctionTemplate {
-  StringRef Name;
-  FunctionType *Type;
-  bool IsVarArg;
-};
-
-static std::vector<SanitizerFunctionTemplate>
-get_sanitizer_functions(LLVMContext &Ctx) {
-  auto voidTy = Type::getVoidTy(Ctx);
-  auto locali64PtrTy = PointerType::get(
-      IntegerType::getInt64Ty(Ctx),
-      LocalAddressSpace); // addrspace(3) pointer to unsigned long
-  auto i32Ty = IntegerType::getInt32Ty(Ctx);
-  auto i64Ty = IntegerType::getInt64Ty(Ctx);
-
-  return {
-      // Report functions
-      {"libscsan_report_index_out_of_bounds",
-       FunctionType::get(voidTy, {}, false), false},
-      {"libscsan_report_local_memory_conflict",
-       FunctionType::get(voidTy, {i64Ty}, false), false},
-
-      // Shadow functions
-      {"libscsan_shadow_memset",
-       FunctionType::get(voidTy, {locali64PtrTy, i64Ty, i64Ty}, false), false},
-  };
-}
-
-struct SanitizerFunction {
-  StringRef Name;
-  FunctionType *Type;
-  bool IsVarArg;
-  FunctionCallee Callee;
-
-  SanitizerFunction(const SanitizerFunctionTemplate &temp,
-                    const FunctionCallee callee)
-      : Name(temp.Name), Type(temp.Type), IsVarArg(temp.IsVarArg),
-        Callee(callee) {}
-};
-
-static std::vector<SanitizerFunction> sanitizer_functions{};
-
-static void setup_extern_functions(Module &M) {
-  // Ensure that the module has the required external functions
-  auto &Context = M.getContext();
-
-  for (const auto &Func : get_sanitizer_functions(Context)) {
-    // Insert the function into the module
-    auto F = insert_fn(M, Func.Name, Func.Type->getReturnType(),
-                       Func.Type->params(), Func.IsVarArg);
-
-    sanitizer_functions.push_back({Func, F});
-  }
-}
-
 struct ShadowLocalMemLink {
+  // Shadow in local memory, null when it is spilled
   GlobalVariable *ShadowVar;
   GlobalVariable *OriginalVar;
+  // Bytes of OriginalVar covered by one shadow cell
+  uint64_t Granularity;
+  ArrayType *ShadowTy;
+  // Offset in the work-group's slice of global memory of a spilled shadow
+  std::optional<uint64_t> SpillOffset;
 };
 
 struct ArraySizeLink {
@@ -115,44 +282,109 @@ struct ArraySizeLink {
   Argument *SizeArg;
 };
 
-static CallInst *add_sanitizer_call(IRBuilder<> &Builder, const StringRef Name,
-                                    ArrayRef<Value *> Args) {
-  const auto Func =
-      std::find_if(sanitizer_functions.begin(), sanitizer_functions.end(),
-                   [&](const SanitizerFunction &F) { return F.Name == Name; });
-
-  if (Func == sanitizer_functions.end()) {
-    errs() << "Sanitizer function not found: " << Name << "\n";
-
-    return nullptr;
-  }
+// Runtime library functions and shadow memory of one module. Resolved once
+// before any function of the module is instrumented.
+struct SanitizerRuntime {
+  // Report functions
+  FunctionCallee ReportIndexOutOfBounds;
+  FunctionCallee ReportLocalMemoryConflict;
+
+  // Dispatch-wide abort flag of -scsan-on-error=abort
+  FunctionCallee Poison;
+  FunctionCallee IsPoisoned;
+  FunctionCallee IsPoisonedWorkGroup;
+
+  // Functions other than kernels that return early after a failed check,
+  // and the stop flag of each work-item in local memory that tells their
+  // callers so with -scsan-on-error=return. The flags are dropped again
+  // when no helper can stop.
+  SmallPtrSet<Function *, 8> StoppingFunctions;
+  GlobalVariable *Stopped = nullptr;
+
+  // Shadow functions
+  FunctionCallee ShadowEnter;
+  FunctionCallee ShadowBarrier;
+  FunctionCallee ShadowReset;
+  FunctionCallee ShadowSync;
+  FunctionCallee ShadowClaim16;
+  FunctionCallee ShadowClaim32;
+  FunctionCallee ShadowStamp16;
+  FunctionCallee ShadowStamp32;
+
+  // The same on shadows spilled to global memory
+  FunctionCallee ShadowSpillSlice;
+  FunctionCallee ShadowResetGlobal;
+  FunctionCallee ShadowClaimGlobal16;
+  FunctionCallee ShadowClaimGlobal32;
+  FunctionCallee ShadowStampGlobal16;
+  FunctionCallee ShadowStampGlobal32;
+
+  std::vector<ShadowLocalMemLink> ShadowLocalMemLinks;
+
+  // Bytes of a work-group's slice of spilled shadows, and local memory each
+  // kernel uses once instrumented
+  uint64_t SpillSliceBytes = 0;
+  DenseMap<const Function *, uint64_t> LocalFootprints;
+
+  // Slice of the function being instrumented
+  Value *SpillSlice = nullptr;
+
+  // Shadow cells are [epoch | read | owner]; the owner is local linear id + 1,
+  // or all ones for a cell read by several work-items
+  IntegerType *ShadowCellTy = nullptr;
+  unsigned OwnerBits = 0;
+  unsigned EpochBits = 0;
+
+  // The current barrier epoch of each work-item, in local memory
+  GlobalVariable *ShadowEpochs = nullptr;
+
+  // Global memory races, and the number of barriers fencing global memory
+  // each work-item passed in local memory
+  FunctionCallee GlobalEnter;
+  FunctionCallee GlobalBarrier;
+  FunctionCallee GlobalWrite;
+  GlobalVariable *GlobalPhases = nullptr;
+
+  // Barrier arrival checks
+  FunctionCallee BarrierEnter;
+  FunctionCallee BarrierArrive;
+  FunctionCallee BarrierCheck;
+
+  // Barriers to check in each function, planned before any check is
+  // inserted, and the arrival count they share in local memory
+  DenseMap<const Function *, SmallVector<CallInst *, 4>> CheckedBarriers;
+  GlobalVariable *BarrierArrivals = nullptr;
+  // Functions that may reach a checked barrier, directly or through calls
+  SmallPtrSet<const Function *, 16> ReachCheckedBarriers;
+  // The kernel barrier every checked one follows, which also publishes the
+  // reset of the arrival count at entry
+  DenseMap<const Function *, const CallInst *> EntryBarriers;
+
+  // Sampling
+  FunctionCallee SampleWorkGroup;
+
+  // Array/size links of the helpers that got hidden size arguments, in place
+  // of the ones found in their signature
+  DenseMap<const Function *, std::vector<ArraySizeLink>> PropagatedLinks;
+
+  // Specialization constant backed feature switches
+  FunctionCallee FeatureEnabled;
+
+  // Remarks of the function being instrumented
+  OptimizationRemarkEmitter *ORE = nullptr;
+
+  // Next check site id. 0 is reserved for unknown sites.
+  uint32_t NextSiteId = 1;
+};
 
-  auto *Call = Builder.CreateCall(Func->Callee, Args);
+static CallInst *add_sanitizer_call(IRBuilder<> &Builder, FunctionCallee Callee,
+                                    ArrayRef<Value *> Args) {
+  auto *Call = Builder.CreateCall(Callee, Args);
   Call->setCallingConv(CallingConv::SPIR_FUNC);
 
   return Call;
 }
 
-static CallInst *create_atomic_exchange_call(IRBuilder<> &Builder, Value *Ptr,
-                                             Value *Val) {
-  auto AtomicExchangeFC =
-      Builder.GetInsertBlock()->getModule()->getOrInsertFunction(
-          "_Z15atomic_exchangePU3AS4VU7_Atomicmm",
-          FunctionType::get(
-              IntegerType::getInt64Ty(Builder.getContext()),
-              {PointerType::get(IntegerType::getInt64Ty(Builder.getContext()),
-                                4),
-               Val->getType()},
-              false));
-  auto CastPtr = Builder.CreateAddrSpaceCast(Ptr, PointerType::get(
-      IntegerType::getInt64Ty(Builder.getContext()), 4));
-
-  auto *AtomicExchangeFunc = cast<Function>(AtomicExchangeFC.getCallee());
-  AtomicExchangeFunc->setCallingConv(CallingConv::SPIR_FUNC);
-
-  return Builder.CreateCall(AtomicExchangeFC, {CastPtr, Val});
-}
-
 static CallInst *create_get_global_id_call(IRBuilder<> &Builder, unsigned dim) {
   auto GetGlobalIdFC =
       Builder.GetInsertBlock()->getModule()->getOrInsertFunction(
@@ -178,35 +410,210 @@ static CallInst *create_get_local_id_call(IRBuilder<> &Builder, unsigned dim) {
   auto *GetLocalIdFunc = cast<Function>(GetLocalIdFC.getCallee());
   GetLocalIdFunc->setCallingConv(CallingConv::SPIR_FUNC);
 
-  return Builder.CreateCall(
-      GetLocalIdFunc,
+  auto *Call = Builder.CreateCall(
+      GetLocalIdFC,
       {ConstantInt::get(IntegerType::getInt32Ty(Builder.getContext()), dim)});
+  Call->setCallingConv(CallingConv::SPIR_FUNC);
+
+  return Call;
 }
 
-static std::optional<std::pair<BasicBlock::iterator, Argument *>>
-find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
-                    BasicBlock::iterator Inst,
-                    const GetElementPtrInst *GetElementPtr) {
-  // Find the array argument in the GEP instruction
-  if (GetElementPtr->getNumOperands() != 2) {
-    errs() << "Skipping GEP with unexpected number of operands: "
-           << *GetElementPtr << "\n";
+static CallInst *create_get_local_linear_id_call(IRBuilder<> &Builder) {
+  auto GetLocalLinearIdFC =
+      Builder.GetInsertBlock()->getModule()->getOrInsertFunction(
+          get_local_linear_id_name,
+          FunctionType::get(IntegerType::getInt64Ty(Builder.getContext()),
+                            false));
+  auto *GetLocalLinearIdFunc = cast<Function>(GetLocalLinearIdFC.getCallee());
+  GetLocalLinearIdFunc->setCallingConv(CallingConv::SPIR_FUNC);
 
-    return std::nullopt;
+  auto *Call = Builder.CreateCall(GetLocalLinearIdFunc);
+  Call->setCallingConv(CallingConv::SPIR_FUNC);
+
+  return Call;
+}
+
+// Move [At, end) of Block into a new block. Successor PHIs are updated to
+// point at the new block, which now holds the terminator.
+static BasicBlock *split_block_at(Function &F, BasicBlock &Block,
+                                  BasicBlock::iterator At) {
+  auto *Tail = BasicBlock::Create(F.getContext(), "", &F);
+
+  Tail->splice(Tail->begin(), &Block, At, Block.end());
+  Tail->replaceSuccessorsPhiUsesWith(&Block, Tail);
+
+  return Tail;
+}
+
+// Whether the host left Feature on. Once the runtime is linked in this is a
+// specialization constant, so the driver folds the branches on it.
+static Value *create_feature_enabled(IRBuilder<> &Builder, unsigned Feature,
+                                     const SanitizerRuntime &RT) {
+  return Builder.CreateIsNotNull(add_sanitizer_call(
+      Builder, RT.FeatureEnabled, {Builder.getInt32(Feature)}));
+}
+
+// The code emitted between begin_feature_guard and end_feature_guard only
+// runs while Feature is on. Returns the block the Builder continues in.
+static BasicBlock *begin_feature_guard(IRBuilder<> &Builder, unsigned Feature,
+                                       const SanitizerRuntime &RT) {
+  auto &F = *Builder.GetInsertBlock()->getParent();
+  auto *Head = Builder.GetInsertBlock();
+  auto *Enabled = create_feature_enabled(Builder, Feature, RT);
+  auto *Tail = split_block_at(F, *Head, Builder.GetInsertPoint());
+  auto *Guarded = BasicBlock::Create(F.getContext(), "", &F, Tail);
+
+  Builder.SetInsertPoint(Head);
+  Builder.CreateCondBr(Enabled, Guarded, Tail);
+  Builder.SetInsertPoint(Guarded);
+
+  return Tail;
+}
+
+// Returns Result where the guarded code ran and zero where it did not
+static Value *end_feature_guard(IRBuilder<> &Builder, BasicBlock *Tail,
+                                Value *Result = nullptr) {
+  auto *Guarded = Builder.GetInsertBlock();
+
+  Builder.CreateBr(Tail);
+  Builder.SetInsertPoint(Tail, Tail->begin());
+
+  if (!Result) {
+    return nullptr;
+  }
+
+  auto *Phi = Builder.CreatePHI(Result->getType(), 2);
+
+  for (auto *Pred : predecessors(Tail)) {
+    Phi->addIncoming(
+        Pred == Guarded ? Result : Constant::getNullValue(Result->getType()),
+        Pred);
+  }
+
+  return Phi;
+}
+
+// Assign the next site id to a check guarding Inst. Ids only depend on the
+// module, so they are stable across builds of the same source.
+static ConstantInt *create_site_id(SanitizerRuntime &RT,
+                                   const Instruction &Inst,
+                                   const StringRef Kind) {
+  const auto SiteId = RT.NextSiteId++;
+
+  LLVM_DEBUG(dbgs() << "Check site #" << SiteId << " (" << Kind << ") in "
+                    << Inst.getFunction()->getName() << ": " << Inst << "\n");
+
+  RT.ORE->emit([&] {
+    return OptimizationRemark(DEBUG_TYPE, "CheckInserted", &Inst)
+           << ore::NV("Kind", Kind) << " check, site #"
+           << ore::NV("SiteId", SiteId);
+  });
+
+  return ConstantInt::get(Type::getInt32Ty(Inst.getContext()), SiteId);
+}
+
+// Leave the function. Its result is never looked at: callers poll the stop
+// or poison flag right after the call and return in turn, up to the kernel.
+static void create_early_return(IRBuilder<> &Builder) {
+  auto *RetTy = Builder.GetInsertBlock()->getParent()->getReturnType();
+
+  if (RetTy->isVoidTy()) {
+    Builder.CreateRetVoid();
+  } else {
+    Builder.CreateRet(PoisonValue::get(RetTy));
+  }
+}
+
+// This work-item's byte of RT.Stopped
+static Value *create_stop_flag_ptr(IRBuilder<> &Builder,
+                                   const SanitizerRuntime &RT) {
+  auto *LocalId = create_get_local_linear_id_call(Builder);
+
+  return Builder.CreateInBoundsGEP(
+      RT.Stopped->getValueType(), RT.Stopped,
+      {ConstantInt::get(LocalId->getType(), 0), LocalId});
+}
+
+// End a block that reported a failed check as -scsan-on-error says.
+// Continue is where the checked access is performed.
+static void create_error_exit(IRBuilder<> &Builder, BasicBlock *Continue,
+                              SanitizerRuntime &RT) {
+  auto &F = *Builder.GetInsertBlock()->getParent();
+  const auto IsKernel = F.getCallingConv() == CallingConv::SPIR_KERNEL;
+
+  switch (ClOnError) {
+  case ErrorAction::Recover:
+    Builder.CreateBr(Continue);
+    return;
+  case ErrorAction::Abort:
+    add_sanitizer_call(Builder, RT.Poison, {});
+    break;
+  case ErrorAction::Return:
+    if (!IsKernel) {
+      Builder.CreateStore(Builder.getInt8(1),
+                          create_stop_flag_ptr(Builder, RT));
+    }
+    break;
+  }
+
+  if (!IsKernel) {
+    RT.StoppingFunctions.insert(&F);
   }
 
-  auto *PtrOperand_ = GetElementPtr->getOperand(0);
-  auto *PtrOperand = dyn_cast<Argument>(PtrOperand_);
+  create_early_return(Builder);
+}
+
+static BasicBlock *create_index_out_of_bounds_block(Function &F,
+                                                    SanitizerRuntime &RT,
+                                                    const Instruction &Access,
+                                                    BasicBlock *Continue) {
+  auto *ElseBlock = BasicBlock::Create(F.getContext(), "", &F);
+
+  IRBuilder<> ElseBuilder(ElseBlock);
+
+  auto *Reported = begin_feature_guard(ElseBuilder, FeatureReporting, RT);
+
+  add_sanitizer_call(ElseBuilder, RT.ReportIndexOutOfBounds,
+                     {create_site_id(RT, Access, "index out of bounds")});
+  end_feature_guard(ElseBuilder, Reported);
+
+  create_error_exit(ElseBuilder, Continue, RT);
+
+  return ElseBlock;
+}
+
+static const ArraySizeLink *
+find_array_size_link(const std::vector<ArraySizeLink> &ArraySizeLinks,
+                     const Argument *ArrayArg) {
+  const auto Link = std::find_if(
+      ArraySizeLinks.begin(), ArraySizeLinks.end(),
+      [&](const ArraySizeLink &L) { return L.ArrayArg == ArrayArg; });
+
+  return Link == ArraySizeLinks.end() ? nullptr : &*Link;
+}
+
+static bool match_zero(const Value *V) {
+  const auto *C = dyn_cast<ConstantInt>(V);
+
+  return C && C->isZero();
+}
+
+// Array argument Ptr refers to: the argument itself, or a load of it from
+// the alloca the front end spills it to, through bit and address space casts
+static Argument *find_array_argument(Value *Ptr) {
+  Ptr = Ptr->stripPointerCasts();
+
+  auto *PtrOperand = dyn_cast<Argument>(Ptr);
 
   if (!PtrOperand) {
     // If the pointer operand is not an argument, check if it's a load
-    auto PtrLoad = dyn_cast<LoadInst>(PtrOperand_);
+    auto PtrLoad = dyn_cast<LoadInst>(Ptr);
 
     if (!PtrLoad) {
-      errs() << "Skipping GEP with non-argument pointer operand: "
-             << *PtrOperand_ << "\n";
+      LLVM_DEBUG(dbgs() << "Skipping access with non-argument pointer operand: "
+                        << *Ptr << "\n");
 
-      return std::nullopt; // Not an argument, skip
+      return nullptr; // Not an argument, skip
     }
 
     PtrOperand = dyn_cast<Argument>(PtrLoad->getPointerOperand());
@@ -216,10 +623,10 @@ find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
       auto PtrAlloca = dyn_cast<AllocaInst>(PtrLoad->getPointerOperand());
 
       if (!PtrAlloca) {
-        errs() << "Skipping GEP with non-argument pointer load: "
-               << *PtrOperand_ << "\n";
+        LLVM_DEBUG(dbgs() << "Skipping access with non-argument pointer load: "
+                          << *Ptr << "\n");
 
-        return std::nullopt; // Not an argument, skip
+        return nullptr; // Not an argument, skip
       }
 
       // Find the first store instruction that stores to the alloca
@@ -230,27 +637,111 @@ find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
           });
 
       if (MaybeStore == PtrAlloca->user_end()) {
-        errs() << "Skipping GEP with alloca that has no store: " << *PtrAlloca
-               << "\n";
+        LLVM_DEBUG(dbgs() << "Skipping access with alloca that has no store: "
+                          << *PtrAlloca << "\n");
 
-        return std::nullopt; // No store found, skip
+        return nullptr; // No store found, skip
       }
 
       PtrOperand =
           dyn_cast<Argument>(cast<StoreInst>(*MaybeStore)->getOperand(0));
 
       if (!PtrOperand) {
-        errs() << "Skipping GEP with alloca that has non-argument store: "
-               << *PtrOperand_ << "\n";
+        LLVM_DEBUG(dbgs() << "Skipping access with alloca that has "
+                             "non-argument store: "
+                          << *Ptr << "\n");
 
-        return std::nullopt; // Not an argument, skip
+        return nullptr; // Not an argument, skip
       }
     }
   } else if (!PtrOperand->getType()->isPointerTy()) {
-    errs() << "Skipping GEP with non-pointer array argument: " << *PtrOperand_
-           << "\n";
+    LLVM_DEBUG(dbgs() << "Skipping access with non-pointer array argument: "
+                      << *Ptr << "\n");
+
+    return nullptr; // Not a pointer type, skip
+  }
+
+  return PtrOperand;
+}
+
+// Array argument every path to Ptr starts from, looking through GEPs, phis
+// and selects as well, as optimized code leaves them. The offset from the
+// argument is then only known at run time.
+static Argument *find_underlying_array_argument(Value *Ptr) {
+  SmallVector<const Value *, 4> Objects;
+  Argument *Found = nullptr;
+
+  getUnderlyingObjects(Ptr, Objects);
+
+  for (const auto *Object : Objects) {
+    auto *ArrayArg = find_array_argument(const_cast<Value *>(Object));
+
+    if (!ArrayArg || (Found && ArrayArg != Found)) {
+      LLVM_DEBUG(dbgs() << "Skipping pointer without a single underlying "
+                           "array argument: "
+                        << *Ptr << "\n");
+
+      return nullptr;
+    }
+
+    Found = ArrayArg;
+  }
+
+  return Found;
+}
+
+// Whether every load and store through GEP touches exactly one element of a
+// scalar source type, so that `index < size` covers it
+static bool accesses_single_elements(const GetElementPtrInst *GEP) {
+  auto *ElemTy = GEP->getSourceElementType();
+
+  if (ElemTy->isVectorTy() || ElemTy->isAggregateType()) {
+    return false;
+  }
+
+  const auto &DL = GEP->getModule()->getDataLayout();
+  const auto ElemBytes = DL.getTypeStoreSize(ElemTy).getFixedValue();
+
+  for (const auto *U : GEP->users()) {
+    if (const auto *Load = dyn_cast<LoadInst>(U);
+        Load && DL.getTypeStoreSize(Load->getType()) != ElemBytes) {
+      return false;
+    }
+
+    if (const auto *Store = dyn_cast<StoreInst>(U);
+        Store && Store->getPointerOperand() == GEP &&
+        DL.getTypeStoreSize(Store->getValueOperand()->getType()) !=
+            ElemBytes) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static std::optional<std::pair<BasicBlock::iterator, Argument *>>
+find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
+                    BasicBlock::iterator Inst,
+                    const GetElementPtrInst *GetElementPtr) {
+  // Find the array argument in the GEP instruction
+  if (GetElementPtr->getNumOperands() != 2) {
+    LLVM_DEBUG(dbgs() << "Skipping GEP with unexpected number of operands: "
+                      << *GetElementPtr << "\n");
+
+    return std::nullopt;
+  }
+
+  if (!accesses_single_elements(GetElementPtr)) {
+    LLVM_DEBUG(dbgs() << "Skipping GEP checked as a byte range: "
+                      << *GetElementPtr << "\n");
+
+    return std::nullopt;
+  }
+
+  auto *PtrOperand = find_array_argument(GetElementPtr->getOperand(0));
 
-    return std::nullopt; // Not a pointer type, skip
+  if (!PtrOperand) {
+    return std::nullopt;
   }
 
   // Find the size argument in the GEP instruction
@@ -258,8 +749,8 @@ find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
   const auto *IndexOperand = dyn_cast<Value>(IndexOperand_);
 
   if (!IndexOperand || !IndexOperand->getType()->isIntegerTy()) {
-    errs() << "Skipping GEP with non-integer size argument: " << *IndexOperand_
-           << "\n";
+    LLVM_DEBUG(dbgs() << "Skipping GEP with non-integer size argument: "
+                      << *IndexOperand_ << "\n");
 
     return std::nullopt; // Not an integer type, skip
   }
@@ -272,8 +763,8 @@ find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
                   });
 
   if (!is_linked) {
-    errs() << "Found GEP with unlinked array and size arguments: "
-           << *PtrOperand << ", " << *IndexOperand << "\n";
+    LLVM_DEBUG(dbgs() << "Found GEP with unlinked array and size arguments: "
+                      << *PtrOperand << ", " << *IndexOperand << "\n");
 
     return std::nullopt;
   }
@@ -281,402 +772,3678 @@ find_injectable_gep(std::vector<ArraySizeLink> &ArraySizeLinks,
   return std::make_pair(Inst, PtrOperand);
 }
 
-static std::optional<std::pair<BasicBlock::iterator, GlobalVariable *>>
-find_injectable_local_mem_store(
-    std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks,
-    BasicBlock::iterator Inst, const StoreInst *Store) {
-  // Check if the store instruction is storing to a pointer with
-  // addrspace(3)
-  if (getLoadStoreAddressSpace(Store) != LocalAddressSpace) {
-    errs() << "Skipping store to non-local memory: " << *Store << "\n";
-
-    return std::nullopt; // Skip stores to non-local memory
-  }
-
-  // Find shadow local memory variable
-  auto StorePtrGEP = dyn_cast<GetElementPtrInst>(Store->getPointerOperand());
+// An access checked as `offset + access bytes <= size * element bytes`:
+// loads and stores through multi-index GEPs, vector or aggregate elements,
+// wider than their element, and the vloadn/vstoren builtins
+struct RangeAccess {
+  BasicBlock::iterator Inst;
+  Argument *ArrayArg;
+  // Pointer operand, plus VectorOffset * VectorBytes for vloadn/vstoren
+  Value *Ptr;
+  Value *VectorOffset;
+  uint64_t VectorBytes;
+  // Bytes of one element of ArrayArg, the unit of its size argument
+  uint64_t ElemBytes;
+  // Bytes touched from the start of the access, widened by merging
+  uint64_t AccessBytes;
+  // Ptr does not reach ArrayArg through GEPs alone, so the offset is the
+  // difference of the two addresses
+  bool ByAddress;
+};
 
-  if (!StorePtrGEP) {
-    errs() << "Skipping store with non-GEP pointer operand: " << *Store << "\n";
+// vloadn(offset, p) and vstoren(data, offset, p). Returns n, or 0 for any
+// other call.
+static unsigned get_vector_builtin_width(const CallInst &Call, bool &IsStore) {
+  const auto *Callee = Call.getCalledFunction();
 
-    return std::nullopt; // Not a GEP, skip
+  if (!Callee) {
+    return 0;
   }
 
-  auto MaybeShadowVar = std::find_if(
-      ShadowLocalMemLinks.begin(), ShadowLocalMemLinks.end(),
-      [&](const ShadowLocalMemLink &Link) {
-        return Link.OriginalVar == StorePtrGEP->getPointerOperand();
-      });
-
-  if (MaybeShadowVar == ShadowLocalMemLinks.end()) {
-    errs() << "Skipping store with unlinked shadow variable: " << *Store
-           << "\n";
+  StringRef Name = Callee->getName();
+  unsigned Length;
 
-    return std::nullopt; // No linked shadow variable found, skip
+  if (!Name.consume_front("_Z") || Name.consumeInteger(10, Length) ||
+      Name.size() < Length) {
+    return 0;
   }
 
-  return std::make_pair(Inst, MaybeShadowVar->ShadowVar);
-}
+  auto Identifier = Name.take_front(Length);
 
-static std::pair<BasicBlock *, BranchInst *>
-inject_gep_check(Function &F, BasicBlock &Block, IRBuilder<> &Builder,
-                 std::vector<ArraySizeLink> &ArraySizeLinks,
-                 const std::pair<BasicBlock::iterator, Argument *> &gep_pair) {
-  auto GetElementPtr = gep_pair.first;
-  auto *PtrOperand = gep_pair.second;
+  IsStore = Identifier.consume_front("vstore");
 
-  const auto IndexOperand = GetElementPtr->getOperand(1);
-  const auto LinkEntry =
-      std::find_if(ArraySizeLinks.begin(), ArraySizeLinks.end(),
-                   [&](const ArraySizeLink &Link) {
-                     return Link.ArrayArg->getArgNo() == PtrOperand->getArgNo();
-                   });
+  if (!IsStore && !Identifier.consume_front("vload")) {
+    return 0;
+  }
 
-  if (LinkEntry == ArraySizeLinks.end()) {
-    errs() << "No size argument found for the array argument: " << *PtrOperand
-           << "\n";
+  unsigned Width;
 
-    return {}; // No size argument found
+  if (Identifier.getAsInteger(10, Width)) {
+    return 0; // vload_half and friends
   }
 
-  auto *SizeArg = LinkEntry->SizeArg;
-
-  auto *ThenBlock = BasicBlock::Create(F.getContext(), "", &F);
-  auto *ElseBlock = BasicBlock::Create(F.getContext(), "", &F);
+  return Width;
+}
 
-  // Move all instructions after the last GEP instruction to the new block
-  ThenBlock->splice(ThenBlock->begin(), &Block, GetElementPtr, Block.end());
+// Bytes of one element of ArrayArg, the unit of its size argument: the type
+// every GEP straight off the argument steps over. Unknown when there is no
+// such GEP or they disagree, as when the buffer is viewed as several types.
+static std::optional<uint64_t> get_array_element_bytes(Argument &ArrayArg) {
+  const auto &DL = ArrayArg.getParent()->getParent()->getDataLayout();
+  std::optional<uint64_t> Bytes;
 
-  IRBuilder<> ElseBuilder(ElseBlock);
+  for (auto &Inst : instructions(*ArrayArg.getParent())) {
+    const auto *GEP = dyn_cast<GetElementPtrInst>(&Inst);
 
-  add_sanitizer_call(ElseBuilder, "libscsan_report_index_out_of_bounds", {});
+    if (!GEP || find_array_argument(GEP->getPointerOperand()) != &ArrayArg) {
+      continue;
+    }
 
-  ElseBuilder.CreateRetVoid();
+    const auto GEPBytes =
+        DL.getTypeAllocSize(GEP->getSourceElementType()).getFixedValue();
 
-  return {ThenBlock,
-          Builder.CreateCondBr(Builder.CreateICmpULT(IndexOperand, SizeArg),
-                               ThenBlock, ElseBlock)};
-}
+    if (Bytes && *Bytes != GEPBytes) {
+      return std::nullopt;
+    }
 
-static std::pair<BasicBlock *, BranchInst *> inject_shadow_local_mem_check(
-    Function &F, BasicBlock &Block, IRBuilder<> &Builder,
-    std::pair<BasicBlock::iterator, GlobalVariable *> shadow_var_pair) {
-  auto Store = shadow_var_pair.first;
-  auto *ShadowBufVar = shadow_var_pair.second;
-  auto ShadowVarTy = ShadowBufVar->getValueType()->getArrayElementType();
-  auto GEPOperand =
-      cast<GetElementPtrInst>(cast<StoreInst>(Store)->getPointerOperand());
-  auto IndexOperand = GEPOperand->getOperand(GEPOperand->getNumOperands() -
-                                             1); // Get last operand
+    Bytes = GEPBytes;
+  }
 
-  Builder.SetInsertPoint(Store);
+  return Bytes;
+}
 
-  auto *ShadowPtr = Builder.CreateInBoundsGEP(
-      ShadowBufVar->getValueType(), ShadowBufVar,
-      {ConstantInt::get(Type::getInt64Ty(F.getContext()), 0), IndexOperand});
+static std::optional<RangeAccess>
+find_range_access(std::vector<ArraySizeLink> &ArraySizeLinks,
+                  BasicBlock::iterator Inst) {
+  const auto &DL = Inst->getModule()->getDataLayout();
+  RangeAccess Range{Inst, nullptr, nullptr, nullptr, 0, 0, 0, false};
+
+  if (isa<LoadInst, StoreInst>(Inst)) {
+    auto *Ptr = getLoadStorePointerOperand(&*Inst);
+    auto *GEP = dyn_cast<GetElementPtrInst>(Ptr->stripPointerCasts());
+
+    // Single element accesses straight off the array are covered by the
+    // check on their GEP
+    if (GEP && GEP->getNumOperands() == 2 && accesses_single_elements(GEP) &&
+        Ptr == GEP && find_array_argument(GEP->getPointerOperand())) {
+      return std::nullopt;
+    }
 
-  auto BuilderCurrLid = Builder.CreateAdd(create_get_local_id_call(Builder, 0), ConstantInt::get(ShadowVarTy, 1));
-  auto *ShadowVar = create_atomic_exchange_call(Builder, ShadowPtr, BuilderCurrLid);
-  auto *ShadowVarArea = Builder.CreateAlloca(ShadowVarTy);
+    // Until a GEP says otherwise, the size counts accessed scalars
+    Range.Ptr = Ptr->stripPointerCasts();
+    Range.ElemBytes =
+        DL.getTypeStoreSize(getLoadStoreType(&*Inst)->getScalarType())
+            .getFixedValue();
+    Range.AccessBytes =
+        DL.getTypeStoreSize(getLoadStoreType(&*Inst)).getFixedValue();
+  } else if (const auto *Call = dyn_cast<CallInst>(Inst)) {
+    bool IsStore = false;
+    const auto Width = get_vector_builtin_width(*Call, IsStore);
+
+    if (!Width) {
+      return std::nullopt;
+    }
 
-  Builder.CreateStore(ShadowVar, ShadowVarArea);
+    auto *VectorTy = dyn_cast<VectorType>(
+        IsStore ? Call->getArgOperand(0)->getType() : Call->getType());
 
-  auto ThenBlock = BasicBlock::Create(F.getContext(), "", &F);
-  auto ElseBlock = BasicBlock::Create(F.getContext(), "", &F);
+    if (!VectorTy || Call->arg_size() != (IsStore ? 3u : 2u)) {
+      return std::nullopt;
+    }
 
-  auto EQCond = Builder.CreateICmpEQ(ShadowVar, BuilderCurrLid);
-  auto FirstWriteCond = Builder.CreateICmpEQ(ShadowVar, ConstantInt::get(ShadowVarTy, 0));
+    Range.Ptr = Call->getArgOperand(IsStore ? 2 : 1);
+    Range.VectorOffset = Call->getArgOperand(IsStore ? 1 : 0);
+    Range.ElemBytes =
+        DL.getTypeStoreSize(VectorTy->getElementType()).getFixedValue();
+    Range.VectorBytes = Width * Range.ElemBytes;
+    Range.AccessBytes = Range.VectorBytes;
+  } else {
+    return std::nullopt;
+  }
 
-  Builder.CreateCondBr(Builder.CreateOr(EQCond, FirstWriteCond), ThenBlock,
-                       ElseBlock);
+  // Walk down to the array argument. The outermost GEP indexes the array
+  // itself, so its source type is the element the size counts.
+  auto *Base = Range.Ptr->stripPointerCasts();
 
-  IRBuilder<> ThenBuilder(ThenBlock);
+  while (auto *GEP = dyn_cast<GetElementPtrInst>(Base)) {
+    Range.ElemBytes =
+        DL.getTypeAllocSize(GEP->getSourceElementType()).getFixedValue();
+    Base = GEP->getPointerOperand()->stripPointerCasts();
+  }
 
-  auto ThenBuilderCurrLid = ThenBuilder.CreateAdd(create_get_local_id_call(ThenBuilder, 0), ConstantInt::get(ShadowVarTy, 1));
-  auto *ShadowVar2 = create_atomic_exchange_call(ThenBuilder, ShadowPtr, ThenBuilderCurrLid);
+  Range.ArrayArg = find_array_argument(Base);
 
-  ThenBuilder.CreateStore(ShadowVar2, ShadowVarArea);
+  if (!Range.ArrayArg) {
+    Range.ArrayArg = find_underlying_array_argument(Base);
+    Range.ByAddress = true;
+  }
 
-  // Second check
+  if (!Range.ArrayArg ||
+      !find_array_size_link(ArraySizeLinks, Range.ArrayArg)) {
+    return std::nullopt;
+  }
 
-  auto Then2Block = BasicBlock::Create(F.getContext(), "", &F);
+  // The GEPs walked above stop at the phi or select, so the last one may
+  // step over a field or another view of the buffer
+  if (Range.ByAddress) {
+    const auto ElemBytes = get_array_element_bytes(*Range.ArrayArg);
 
-  Then2Block->splice(Then2Block->begin(), &Block, Store->getIterator(),
-                     Block.end());
+    if (!ElemBytes) {
+      LLVM_DEBUG(dbgs() << "Skipping access to an array of unknown element "
+                           "size: "
+                        << *Inst << "\n");
 
-  auto Branch2Inst = ThenBuilder.CreateCondBr(
-      ThenBuilder.CreateICmpEQ(ShadowVar2, ThenBuilderCurrLid), Then2Block,
-      ElseBlock);
+      return std::nullopt;
+    }
 
-  // In the else block, we have a conflict
-  IRBuilder<> ElseBuilder(ElseBlock);
+    Range.ElemBytes = *ElemBytes;
+  }
 
-  add_sanitizer_call(ElseBuilder, "libscsan_report_local_memory_conflict",
-                     {ElseBuilder.CreateSub(
-                         ElseBuilder.CreateLoad(
-                             ShadowVarArea->getAllocatedType(), ShadowVarArea),
-                         ConstantInt::get(ShadowVarTy, 1))});
+  return Range;
+}
 
-  ElseBuilder.CreateRetVoid();
+// Size of dimension Dim of the kernel's reqd_work_group_size, or of its
+// !scsan.max_global_size metadata
+static std::optional<uint64_t> get_kernel_size_fact(const Function &F,
+                                                    StringRef Kind,
+                                                    unsigned Dim) {
+  const auto *MD = F.getMetadata(Kind);
 
-  return {Then2Block, Branch2Inst};
-}
+  if (!MD || Dim >= MD->getNumOperands()) {
+    return std::nullopt;
+  }
 
-struct TraverseContext {
-  Function &F;
-  std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks;
-  std::vector<ArraySizeLink> &ArraySizeLinks;
-  std::vector<BasicBlock::const_iterator> skipInstructions{};
+  const auto *Size = mdconst::dyn_extract<ConstantInt>(MD->getOperand(Dim));
 
-  TraverseContext(Function &F,
-                  std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks,
-                  std::vector<ArraySizeLink> &ArraySizeLinks)
-      : F(F), ShadowLocalMemLinks(ShadowLocalMemLinks),
-        ArraySizeLinks(ArraySizeLinks) {}
-};
+  if (!Size || Size->isZero()) {
+    return std::nullopt;
+  }
 
-static void traverse(BasicBlock &Block, TraverseContext &Ctx,
-                     const int depth = 0) {
-  std::optional<std::pair<BasicBlock::iterator, GlobalVariable *>>
-      maybe_shadow_var_pair;
-  std::optional<std::pair<BasicBlock::iterator, Argument *>> maybe_gep_pair;
+  return Size->getZExtValue();
+}
 
-  // Create a global string variable once to avoid string deduplication bug
-  IRBuilder<> Builder(&Block);
+// Dimension Dim of the kernel's !scsan.max_global_offset metadata. Unlike
+// a size, 0 is a fact: the kernel is launched without an offset.
+static std::optional<uint64_t> get_kernel_offset_fact(const Function &F,
+                                                      unsigned Dim) {
+  const auto *MD = F.getMetadata("scsan.max_global_offset");
 
-  auto Inst = Block.begin();
+  if (!MD || Dim >= MD->getNumOperands()) {
+    return std::nullopt;
+  }
 
-  for (const auto E = Block.end(); Inst != E; ++Inst) {
-    if (Ctx.skipInstructions.size() > 0 &&
-        std::any_of(Ctx.skipInstructions.begin(), Ctx.skipInstructions.end(),
-                    [&](BasicBlock::const_iterator i) {
-                      return i == Inst->getIterator();
-                    })) {
-      errs() << "Skipping instruction already processed: " << *Inst << "\n";
+  const auto *Offset = mdconst::dyn_extract<ConstantInt>(MD->getOperand(Dim));
 
-      continue; // Skip instructions already processed
-    }
+  if (!Offset) {
+    return std::nullopt;
+  }
 
-    if (const auto *Br = dyn_cast<BranchInst>(Inst)) {
-      // Follow the branch instruction to the next block
-      if (Br->isConditional()) {
-        traverse(*Br->getSuccessor(0), Ctx, depth + 1);
-        traverse(*Br->getSuccessor(1), Ctx, depth + 1);
-      } else {
-        traverse(*Br->getSuccessor(0), Ctx, depth + 1);
-      }
-    }
+  return Offset->getZExtValue();
+}
 
-    // ArrayIndexOutOfBounds: Intercept GEP
-    if (const auto *GetElementPtr = dyn_cast<GetElementPtrInst>(Inst)) {
-      maybe_gep_pair =
-          find_injectable_gep(Ctx.ArraySizeLinks, Inst, GetElementPtr);
+// Whether the kernel is launched with one-dimensional work-groups, so that
+// get_local_id(0) identifies the work-item
+static bool has_1d_work_groups(const Function &F) {
+  const auto *MD = F.getMetadata("reqd_work_group_size");
 
-      if (maybe_gep_pair) {
-        errs() << "Found injectable GEP instruction: " << *Inst << "\n";
+  if (!MD || MD->getNumOperands() != 3) {
+    return false;
+  }
 
-        Ctx.skipInstructions.push_back(GetElementPtr->getIterator());
+  for (unsigned Dim = 1; Dim < 3; ++Dim) {
+    const auto *Size = mdconst::dyn_extract<ConstantInt>(MD->getOperand(Dim));
 
-        break;
-      }
+    if (!Size || !Size->isOne()) {
+      return false;
     }
+  }
 
-    // LocalMemoryConflict: Intercept store
-    if (auto *Store = dyn_cast<StoreInst>(Inst)) {
-      maybe_shadow_var_pair =
-          find_injectable_local_mem_store(Ctx.ShadowLocalMemLinks, Inst, Store);
+  return true;
+}
 
-      if (maybe_shadow_var_pair) {
-        errs() << "Found store to local memory: " << *Store << "\n";
+// Work-items in a work-group of F: the product of its reqd_work_group_size
+static std::optional<uint64_t> get_reqd_work_group_size(const Function &F) {
+  uint64_t Size = 1;
 
-        Ctx.skipInstructions.push_back(Store->getIterator());
+  for (unsigned Dim = 0; Dim < 3; ++Dim) {
+    const auto DimSize = get_kernel_size_fact(F, "reqd_work_group_size", Dim);
 
-        break;
-      }
+    if (!DimSize) {
+      return std::nullopt;
     }
-  }
-
-  if (maybe_shadow_var_pair) {
-    auto [ThenBlock, BI] = inject_shadow_local_mem_check(
-        Ctx.F, Block, Builder, maybe_shadow_var_pair.value());
 
-    traverse(*ThenBlock, Ctx, depth + 1);
+    Size *= *DimSize;
   }
 
-  if (maybe_gep_pair) {
-    auto [ThenBlock, BI] = inject_gep_check(
-        Ctx.F, Block, Builder, Ctx.ArraySizeLinks, maybe_gep_pair.value());
+  return Size;
+}
 
-    traverse(*ThenBlock, Ctx, depth + 1);
+// get_local_linear_id(), or just get_local_id(0) when the other dimensions
+// are statically 1
+static CallInst *create_local_linear_id(IRBuilder<> &Builder,
+                                        const Function &F) {
+  if (has_1d_work_groups(F)) {
+    return create_get_local_id_call(Builder, 0);
   }
-}
 
-static std::vector<ArraySizeLink> find_array_size_links(Function &F) {
-  std::vector<ArraySizeLink> ret;
+  return create_get_local_linear_id_call(Builder);
+}
 
-  std::optional<size_t> FoundArraySizeLink;
-  for (auto &Arg : F.args()) {
-    if (Arg.getType()->isPointerTy()) {
-      if (FoundArraySizeLink) {
-        FoundArraySizeLink.reset();
-      }
+// Value Load reads back from an alloca stored exactly once, as the front end
+// spills locals at -O0
+static const Value *find_spilled_value(const LoadInst *Load) {
+  const auto *Slot = dyn_cast<AllocaInst>(Load->getPointerOperand());
 
-      FoundArraySizeLink = Arg.getArgNo();
-    }
+  if (!Slot) {
+    return nullptr;
+  }
 
-    if (Arg.getType()->isIntegerTy()) {
-      if (Arg.getType()->getIntegerBitWidth() == 64) {
-        if (FoundArraySizeLink) {
-          ret.push_back({F.getArg(FoundArraySizeLink.value()), &Arg});
+  const StoreInst *OnlyStore = nullptr;
 
-          FoundArraySizeLink.reset();
-        }
+  for (const auto *U : Slot->users()) {
+    if (const auto *Store = dyn_cast<StoreInst>(U)) {
+      if (OnlyStore || Store->getPointerOperand() != Slot) {
+        return nullptr;
       }
+
+      OnlyStore = Store;
+    } else if (!isa<LoadInst>(U)) {
+      return nullptr;
     }
   }
 
-  return ret;
+  return OnlyStore ? OnlyStore->getValueOperand() : nullptr;
 }
 
-static std::vector<ShadowLocalMemLink>
-find_shadow_local_mem_links(Function &F) {
-  std::vector<ShadowLocalMemLink> ret;
+// Whether Index is the local id of the executing work-item. Looks through
+// integer casts and allocas stored exactly once, as left by the front end.
+static bool is_own_local_index(const Value *Index, const Function &F) {
+  for (;;) {
+    Index = Index->stripPointerCasts();
 
-  for (auto &Var : F.getParent()->globals()) {
-    if (Var.getType()->getAddressSpace() != LocalAddressSpace) {
-      errs() << "Skipping global variable without addrspace(3): " << Var
-             << "\n";
+    if (const auto *Cast = dyn_cast<CastInst>(Index);
+        Cast && Cast->isIntegerCast()) {
+      Index = Cast->getOperand(0);
 
       continue;
     }
 
-    if (Var.isConstant()) {
-      errs() << "Skipping constant global variable: " << Var << "\n";
+    const auto *Load = dyn_cast<LoadInst>(Index);
 
+    if (!Load) {
+      break;
+    }
+
+    Index = find_spilled_value(Load);
+
+    if (!Index) {
+      return false;
+    }
+  }
+
+  const auto *Call = dyn_cast<CallInst>(Index);
+  const auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+
+  if (!Callee) {
+    return false;
+  }
+
+  if (Callee->getName() == get_local_linear_id_name) {
+    return true;
+  }
+
+  return Callee->getName() == get_local_id_name &&
+         match_zero(Call->getArgOperand(0)) && has_1d_work_groups(F);
+}
+
+// A local memory index as sum(Coeffs[d] * get_local_id(d)) +
+// Coeffs[3] * get_local_linear_id() + a part every work-item of the
+// work-group agrees on
+struct LocalIndexForm {
+  int64_t Coeffs[4] = {};
+};
+
+static constexpr unsigned MaxLocalIndexDepth = 8;
+static constexpr int64_t MaxLocalIndexCoeff = 1 << 24;
+
+static bool is_uniform_form(const LocalIndexForm &Form) {
+  return std::all_of(std::begin(Form.Coeffs), std::end(Form.Coeffs),
+                     [](int64_t Coeff) { return Coeff == 0; });
+}
+
+static bool is_uniform_builtin_call(const CallInst &Call) {
+  const auto *Callee = Call.getCalledFunction();
+
+  return Callee && is_contained(uniform_builtin_names, Callee->getName()) &&
+         std::all_of(Call.arg_begin(), Call.arg_end(),
+                     [](const Use &Arg) { return isa<ConstantInt>(Arg); });
+}
+
+static bool decompose_work_item_call(const CallInst &Call, int64_t Scale,
+                                     LocalIndexForm &Form) {
+  const auto *Callee = Call.getCalledFunction();
+
+  if (!Callee) {
+    return false;
+  }
+
+  const auto Name = Callee->getName();
+
+  if (Name == get_local_linear_id_name) {
+    Form.Coeffs[3] += Scale;
+
+    return true;
+  }
+
+  if (Name == get_local_id_name) {
+    const auto *Dim = dyn_cast<ConstantInt>(Call.getArgOperand(0));
+
+    if (!Dim || Dim->getZExtValue() >= 3) {
+      return false;
+    }
+
+    Form.Coeffs[Dim->getZExtValue()] += Scale;
+
+    return true;
+  }
+
+  return is_uniform_builtin_call(Call);
+}
+
+// Adds Scale * V to Form. Fails for anything that is not affine in the local
+// ids with work-group uniform leaves: constants, kernel arguments and the
+// other work-item builtins.
+static bool decompose_local_index(const Value *V, const Function &F,
+                                  int64_t Scale, LocalIndexForm &Form,
+                                  unsigned Depth = 0) {
+  if (Depth > MaxLocalIndexDepth || Scale > MaxLocalIndexCoeff ||
+      Scale < -MaxLocalIndexCoeff) {
+    return false;
+  }
+
+  if (isa<ConstantInt>(V)) {
+    return true;
+  }
+
+  if (isa<Argument>(V)) {
+    return F.getCallingConv() == CallingConv::SPIR_KERNEL;
+  }
+
+  if (const auto *Cast = dyn_cast<CastInst>(V)) {
+    // Local indices are small, so no cast to 32 bits or more merges two
+    return Cast->isIntegerCast() &&
+           Cast->getType()->getIntegerBitWidth() >= 32 &&
+           decompose_local_index(Cast->getOperand(0), F, Scale, Form,
+                                 Depth + 1);
+  }
+
+  if (const auto *Load = dyn_cast<LoadInst>(V)) {
+    const auto *Stored = find_spilled_value(Load);
+
+    return Stored && decompose_local_index(Stored, F, Scale, Form, Depth + 1);
+  }
+
+  if (const auto *Call = dyn_cast<CallInst>(V)) {
+    return decompose_work_item_call(*Call, Scale, Form);
+  }
+
+  const auto *BinOp = dyn_cast<BinaryOperator>(V);
+
+  if (!BinOp) {
+    return false;
+  }
+
+  const auto *LHS = BinOp->getOperand(0);
+  const auto *RHS = BinOp->getOperand(1);
+
+  switch (BinOp->getOpcode()) {
+  case Instruction::Add:
+    return decompose_local_index(LHS, F, Scale, Form, Depth + 1) &&
+           decompose_local_index(RHS, F, Scale, Form, Depth + 1);
+  case Instruction::Sub:
+    return decompose_local_index(LHS, F, Scale, Form, Depth + 1) &&
+           decompose_local_index(RHS, F, -Scale, Form, Depth + 1);
+  case Instruction::Mul:
+    if (const auto *Factor = dyn_cast<ConstantInt>(RHS)) {
+      return decompose_local_index(LHS, F, Scale * Factor->getSExtValue(),
+                                   Form, Depth + 1);
+    }
+
+    if (const auto *Factor = dyn_cast<ConstantInt>(LHS)) {
+      return decompose_local_index(RHS, F, Scale * Factor->getSExtValue(),
+                                   Form, Depth + 1);
+    }
+
+    break;
+  case Instruction::Shl:
+    if (const auto *Amount = dyn_cast<ConstantInt>(RHS);
+        Amount && Amount->getZExtValue() < 32) {
+      return decompose_local_index(
+          LHS, F, Scale * (int64_t(1) << Amount->getZExtValue()), Form,
+          Depth + 1);
+    }
+
+    break;
+  default:
+    break;
+  }
+
+  // Any other operation on uniform values is uniform
+  LocalIndexForm LHSForm, RHSForm;
+
+  return decompose_local_index(LHS, F, 1, LHSForm, Depth + 1) &&
+         decompose_local_index(RHS, F, 1, RHSForm, Depth + 1) &&
+         is_uniform_form(LHSForm) && is_uniform_form(RHSForm);
+}
+
+// Whether no two work-items of a work-group compute the same Index, so the
+// element it selects is private to one work-item
+static bool is_private_local_index(const Value *Index, const Function &F) {
+  LocalIndexForm Form;
+
+  if (!decompose_local_index(Index, F, 1, Form)) {
+    return false;
+  }
+
+  // The linear id alone already tells work-items apart
+  if (Form.Coeffs[3]) {
+    return !Form.Coeffs[0] && !Form.Coeffs[1] && !Form.Coeffs[2];
+  }
+
+  // Otherwise the coefficients must keep the ids apart like the digits of a
+  // mixed-radix number, which takes the size of every dimension
+  SmallVector<std::pair<uint64_t, uint64_t>, 3> Digits;
+
+  for (unsigned Dim = 0; Dim < 3; ++Dim) {
+    const auto Size = get_kernel_size_fact(F, "reqd_work_group_size", Dim);
+
+    if (!Size) {
+      return false;
+    }
+
+    if (*Size == 1) {
+      continue;
+    }
+
+    if (!Form.Coeffs[Dim]) {
+      return false; // Work-items differing in Dim only collide
+    }
+
+    Digits.push_back({std::abs(Form.Coeffs[Dim]), *Size});
+  }
+
+  llvm::sort(Digits);
+
+  uint64_t Reach = 0;
+
+  for (const auto &[Coeff, Size] : Digits) {
+    if (Coeff <= Reach) {
+      return false;
+    }
+
+    Reach += Coeff * (Size - 1);
+  }
+
+  return true;
+}
+
+// Whether Store writes an element private to its work-item through GEP, and
+// no shadow cell spans two elements, so no other work-item stores to its
+// cell in the same epoch
+static bool is_private_local_store(const StoreInst &Store,
+                                   const GetElementPtrInst &GEP,
+                                   uint64_t Granularity) {
+  const auto &DL = Store.getModule()->getDataLayout();
+  const auto ElemBytes =
+      DL.getTypeAllocSize(GEP.getResultElementType()).getFixedValue();
+
+  return ElemBytes % Granularity == 0 &&
+         is_private_local_index(GEP.getOperand(GEP.getNumOperands() - 1),
+                                *Store.getFunction());
+}
+
+// Whether any store to Var is private to its work-item
+static bool has_private_local_stores(const GlobalVariable &Var,
+                                     uint64_t Granularity) {
+  for (const auto *User : Var.users()) {
+    const auto *GEP = dyn_cast<GetElementPtrInst>(User);
+
+    if (!GEP) {
+      continue;
+    }
+
+    for (const auto *GEPUser : GEP->users()) {
+      const auto *Store = dyn_cast<StoreInst>(GEPUser);
+
+      if (Store && Store->getPointerOperand() == GEP &&
+          is_private_local_store(*Store, *GEP, Granularity)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static std::optional<std::pair<BasicBlock::iterator, const ShadowLocalMemLink *>>
+find_injectable_local_mem_access(
+    const std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks,
+    BasicBlock::iterator Inst, const Instruction *Access) {
+  // Check if the access is to a pointer with addrspace(3)
+  if (getLoadStoreAddressSpace(Access) != LocalAddressSpace) {
+    LLVM_DEBUG(dbgs() << "Skipping access to non-local memory: " << *Access
+                      << "\n");
+
+    return std::nullopt; // Skip accesses to non-local memory
+  }
+
+  // Find shadow local memory variable
+  auto AccessPtrGEP =
+      dyn_cast<GetElementPtrInst>(getLoadStorePointerOperand(Access));
+
+  if (!AccessPtrGEP) {
+    LLVM_DEBUG(dbgs() << "Skipping access with non-GEP pointer operand: "
+                      << *Access << "\n");
+
+    return std::nullopt; // Not a GEP, skip
+  }
+
+  // Only `array, 0, index` and `element, index` shapes are mapped to cells
+  const auto NumOperands = AccessPtrGEP->getNumOperands();
+
+  if (NumOperands != 2 &&
+      !(NumOperands == 3 && match_zero(AccessPtrGEP->getOperand(1)))) {
+    LLVM_DEBUG(dbgs() << "Skipping access with unexpected GEP shape: "
+                      << *Access << "\n");
+
+    return std::nullopt;
+  }
+
+  auto MaybeShadowVar = std::find_if(
+      ShadowLocalMemLinks.begin(), ShadowLocalMemLinks.end(),
+      [&](const ShadowLocalMemLink &Link) {
+        return Link.OriginalVar == AccessPtrGEP->getPointerOperand();
+      });
+
+  if (MaybeShadowVar == ShadowLocalMemLinks.end()) {
+    LLVM_DEBUG(dbgs() << "Skipping access with unlinked shadow variable: "
+                      << *Access << "\n");
+
+    return std::nullopt; // No linked shadow variable found, skip
+  }
+
+  // Reading the work-item's own element cannot race with another reader,
+  // and writes by others are still checked on their side
+  if (isa<LoadInst>(Access) &&
+      is_own_local_index(AccessPtrGEP->getOperand(NumOperands - 1),
+                         *Access->getFunction())) {
+    LLVM_DEBUG(dbgs() << "Skipping load of the work-item's own element: "
+                      << *Access << "\n");
+
+    ++NumOwnElementLoads;
+
+    return std::nullopt;
+  }
+
+  return std::make_pair(Inst, &*MaybeShadowVar);
+}
+
+// A bounds check passes when the feature is turned off, which the driver
+// folds once the specialization constant is known
+static Value *guard_bounds_check(IRBuilder<> &Builder, Value *InBounds,
+                                 Value *BoundsEnabled) {
+  return Builder.CreateOr(Builder.CreateNot(BoundsEnabled), InBounds);
+}
+
+static std::pair<BasicBlock *, BranchInst *>
+inject_gep_check(Function &F, BasicBlock &Block, IRBuilder<> &Builder,
+                 std::vector<ArraySizeLink> &ArraySizeLinks,
+                 const std::pair<BasicBlock::iterator, Argument *> &gep_pair,
+                 Value *IndexOperand, Value *BoundsEnabled,
+                 SanitizerRuntime &RT) {
+  auto GetElementPtr = gep_pair.first;
+  auto *PtrOperand = gep_pair.second;
+
+  const auto LinkEntry =
+      std::find_if(ArraySizeLinks.begin(), ArraySizeLinks.end(),
+                   [&](const ArraySizeLink &Link) {
+                     return Link.ArrayArg->getArgNo() == PtrOperand->getArgNo();
+                   });
+
+  if (LinkEntry == ArraySizeLinks.end()) {
+    LLVM_DEBUG(dbgs() << "No size argument found for the array argument: "
+                      << *PtrOperand << "\n");
+
+    return {}; // No size argument found
+  }
+
+  auto *SizeArg = LinkEntry->SizeArg;
+
+  // Move all instructions after the last GEP instruction to the new block
+  auto *ThenBlock = split_block_at(F, Block, GetElementPtr);
+  auto *ElseBlock =
+      create_index_out_of_bounds_block(F, RT, *GetElementPtr, ThenBlock);
+
+  auto *InBounds = guard_bounds_check(
+      Builder, Builder.CreateICmpULT(IndexOperand, SizeArg), BoundsEnabled);
+
+  ++NumBoundsChecks;
+
+  return {ThenBlock, Builder.CreateCondBr(InBounds, ThenBlock, ElseBlock)};
+}
+
+// Byte offset of Range from the start of its array argument: every GEP
+// index scaled by the type it steps over, or the difference of the
+// addresses when the pointer came through a phi or select, plus the
+// vloadn/vstoren offset. Constant terms are summed up and added once.
+static Value *create_range_offset(IRBuilder<> &Builder, const DataLayout &DL,
+                                  const RangeAccess &Range) {
+  auto *Int64Ty = Builder.getInt64Ty();
+  Value *Offset = nullptr;
+  int64_t ConstantOffset = 0;
+
+  const auto AddTerm = [&](Value *Index, uint64_t Scale) {
+    if (const auto *C = dyn_cast<ConstantInt>(Index)) {
+      ConstantOffset += C->getSExtValue() * int64_t(Scale);
+
+      return;
+    }
+
+    auto *Term = Builder.CreateSExtOrTrunc(Index, Int64Ty);
+
+    if (Scale != 1) {
+      Term = Builder.CreateMul(Term, ConstantInt::get(Int64Ty, Scale));
+    }
+
+    Offset = Offset ? Builder.CreateAdd(Offset, Term) : Term;
+  };
+
+  if (Range.VectorOffset) {
+    // vloadn offsets are unsigned
+    auto *VectorOffset = isa<ConstantInt>(Range.VectorOffset)
+                             ? Range.VectorOffset
+                             : Builder.CreateZExtOrTrunc(Range.VectorOffset,
+                                                         Int64Ty);
+
+    AddTerm(VectorOffset, Range.VectorBytes);
+  }
+
+  if (Range.ByAddress) {
+    auto *Start = Builder.CreatePointerBitCastOrAddrSpaceCast(
+        Range.ArrayArg, Range.Ptr->getType());
+
+    AddTerm(Builder.CreateSub(Builder.CreatePtrToInt(Range.Ptr, Int64Ty),
+                              Builder.CreatePtrToInt(Start, Int64Ty)),
+            1);
+  } else {
+    auto *Ptr = Range.Ptr->stripPointerCasts();
+
+    while (auto *GEP = dyn_cast<GetElementPtrInst>(Ptr)) {
+      for (auto GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E;
+           ++GTI) {
+        if (auto *StructTy = GTI.getStructTypeOrNull()) {
+          const auto Field =
+              cast<ConstantInt>(GTI.getOperand())->getZExtValue();
+
+          ConstantOffset += DL.getStructLayout(StructTy)
+                                ->getElementOffset(Field)
+                                .getFixedValue();
+
+          continue;
+        }
+
+        AddTerm(GTI.getOperand(),
+                DL.getTypeAllocSize(GTI.getIndexedType()).getFixedValue());
+      }
+
+      Ptr = GEP->getPointerOperand()->stripPointerCasts();
+    }
+  }
+
+  auto *Constant = ConstantInt::getSigned(Int64Ty, ConstantOffset);
+
+  if (!Offset) {
+    return Constant;
+  }
+
+  return ConstantOffset ? Builder.CreateAdd(Offset, Constant) : Offset;
+}
+
+static std::pair<BasicBlock *, BranchInst *>
+inject_range_check(Function &F, BasicBlock &Block, IRBuilder<> &Builder,
+                   std::vector<ArraySizeLink> &ArraySizeLinks,
+                   const RangeAccess &Range, Value *BoundsEnabled,
+                   SanitizerRuntime &RT) {
+  const auto *Link = find_array_size_link(ArraySizeLinks, Range.ArrayArg);
+
+  if (!Link) {
+    LLVM_DEBUG(dbgs() << "No size argument found for the array argument: "
+                      << *Range.ArrayArg << "\n");
+
+    return {};
+  }
+
+  // The offset only depends on values defined before the access, so it is
+  // computed in front of it and the access moves to the new block
+  Builder.SetInsertPoint(&*Range.Inst);
+
+  auto *Int64Ty = Builder.getInt64Ty();
+  auto *Offset =
+      create_range_offset(Builder, F.getParent()->getDataLayout(), Range);
+  auto *End =
+      Builder.CreateAdd(Offset, ConstantInt::get(Int64Ty, Range.AccessBytes));
+  auto *Limit =
+      Builder.CreateMul(Builder.CreateZExtOrTrunc(Link->SizeArg, Int64Ty),
+                        ConstantInt::get(Int64Ty, Range.ElemBytes));
+  // A slightly negative offset, e.g. s[i - 1].last with i == 0, wraps End
+  // around to a small value, so the access must also end after it starts
+  auto *InBounds = guard_bounds_check(
+      Builder,
+      Builder.CreateAnd(Builder.CreateICmpULE(Offset, End),
+                        Builder.CreateICmpULE(End, Limit)),
+      BoundsEnabled);
+
+  ++NumRangeChecks;
+
+  if (Range.ByAddress) {
+    ++NumAddressRangeChecks;
+  }
+
+  auto *ThenBlock = split_block_at(F, Block, Range.Inst);
+  auto *ElseBlock =
+      create_index_out_of_bounds_block(F, RT, *Range.Inst, ThenBlock);
+
+  Builder.SetInsertPoint(&Block);
+
+  return {ThenBlock, Builder.CreateCondBr(InBounds, ThenBlock, ElseBlock)};
+}
+
+// Index of the shadow cell covering the element GEP points to
+static Value *create_shadow_index(IRBuilder<> &Builder, const DataLayout &DL,
+                                  const GetElementPtrInst *GEP,
+                                  const ShadowLocalMemLink &Link) {
+  auto *IndexOperand = GEP->getOperand(GEP->getNumOperands() - 1);
+  auto *IndexTy = IndexOperand->getType();
+  const auto ElemSize =
+      DL.getTypeAllocSize(GEP->getResultElementType()).getFixedValue();
+
+  if (ElemSize == Link.Granularity) {
+    return IndexOperand;
+  }
+
+  auto *ByteOffset =
+      Builder.CreateMul(IndexOperand, ConstantInt::get(IndexTy, ElemSize));
+
+  return Builder.CreateUDiv(ByteOffset,
+                            ConstantInt::get(IndexTy, Link.Granularity));
+}
+
+// Start of Link's shadow: its local variable, or its place in the work-group's
+// slice of global memory
+static Value *get_shadow_base(IRBuilder<> &Builder,
+                              const ShadowLocalMemLink &Link,
+                              const SanitizerRuntime &RT) {
+  if (Link.ShadowVar) {
+    return Link.ShadowVar;
+  }
+
+  return Builder.CreateConstInBoundsGEP1_64(Builder.getInt8Ty(), RT.SpillSlice,
+                                            *Link.SpillOffset);
+}
+
+// Record a local load or store in its shadow cell. Within a barrier epoch a
+// cell is written by one work-item or read by any number of them; any other
+// mix is a conflict. Cells from earlier epochs count as clear. LocalTag is
+// the work-item's local linear id + 1 in the cell type and EpochPtr points
+// to its current epoch.
+static std::pair<BasicBlock *, BranchInst *> inject_shadow_local_mem_check(
+    Function &F, BasicBlock &Block, IRBuilder<> &Builder,
+    std::pair<BasicBlock::iterator, const ShadowLocalMemLink *> shadow_var_pair,
+    Value *LocalTag, Value *EpochPtr, SanitizerRuntime &RT) {
+  auto Access = shadow_var_pair.first;
+  const auto &Link = *shadow_var_pair.second;
+  auto ShadowVarTy = Link.ShadowTy->getElementType();
+  auto GEPOperand =
+      cast<GetElementPtrInst>(getLoadStorePointerOperand(&*Access));
+
+  // No other work-item stores to an element private to this one, so only
+  // reads can race with the update and the compare-exchange can go. That
+  // only holds for the cell too when no cell spans two elements.
+  const auto *Store = dyn_cast<StoreInst>(&*Access);
+  const auto IsPrivateStore =
+      Store && is_private_local_store(*Store, *GEPOperand, Link.Granularity);
+  const auto Is16Bit = ShadowVarTy->getIntegerBitWidth() == 16;
+  auto ShadowClaim =
+      IsPrivateStore ? (Is16Bit ? RT.ShadowStamp16 : RT.ShadowStamp32)
+                     : (Is16Bit ? RT.ShadowClaim16 : RT.ShadowClaim32);
+
+  if (!Link.ShadowVar) {
+    ShadowClaim =
+        IsPrivateStore
+            ? (Is16Bit ? RT.ShadowStampGlobal16 : RT.ShadowStampGlobal32)
+            : (Is16Bit ? RT.ShadowClaimGlobal16 : RT.ShadowClaimGlobal32);
+  }
+
+  if (IsPrivateStore) {
+    LLVM_DEBUG(dbgs() << "Stamping store to a work-item's private element: "
+                      << *Access << "\n");
+
+    ++NumShadowStamps;
+  } else {
+    ++NumShadowClaims;
+  }
+
+  ++NumLocalChecks;
+
+  Builder.SetInsertPoint(Access);
+
+  auto *IndexOperand = create_shadow_index(
+      Builder, F.getParent()->getDataLayout(), GEPOperand, Link);
+  auto *ShadowPtr = Builder.CreateInBoundsGEP(
+      Link.ShadowTy, get_shadow_base(Builder, Link, RT),
+      {ConstantInt::get(IndexOperand->getType(), 0), IndexOperand});
+
+  auto *CurrTag = Builder.CreateZExtOrTrunc(LocalTag, ShadowVarTy);
+  auto *Epoch = Builder.CreateZExt(
+      Builder.CreateLoad(Type::getInt8Ty(F.getContext()), EpochPtr),
+      ShadowVarTy);
+  auto *AccessBits = Builder.CreateOr(
+      Builder.CreateShl(Epoch, ConstantInt::get(ShadowVarTy, RT.OwnerBits + 1)),
+      CurrTag);
+
+  if (isa<LoadInst>(*Access)) {
+    AccessBits = Builder.CreateOr(
+        AccessBits, ConstantInt::get(ShadowVarTy, 1ULL << RT.OwnerBits));
+  }
+
+  auto *Checked = begin_feature_guard(Builder, FeatureLocalRaces, RT);
+  auto *Owner = end_feature_guard(
+      Builder, Checked,
+      add_sanitizer_call(
+          Builder, ShadowClaim,
+          {ShadowPtr, AccessBits,
+           ConstantInt::get(Type::getInt32Ty(F.getContext()), RT.OwnerBits)}));
+
+  // The claim returns 0 unless the access conflicts with another owner
+  auto *OkCond = Builder.CreateICmpEQ(Owner, ConstantInt::get(ShadowVarTy, 0));
+
+  auto *ConflictBlock = BasicBlock::Create(F.getContext(), "", &F);
+  auto *TailBlock = split_block_at(F, *Checked, Access->getIterator());
+
+  Builder.SetInsertPoint(Checked);
+
+  auto *Branch = Builder.CreateCondBr(OkCond, TailBlock, ConflictBlock);
+
+  IRBuilder<> ConflictBuilder(ConflictBlock);
+
+  // Several readers are reported without an id
+  auto *SharedOwner =
+      ConstantInt::get(ShadowVarTy, (1ULL << RT.OwnerBits) - 1);
+  auto *PrevId = ConflictBuilder.CreateSelect(
+      ConflictBuilder.CreateICmpEQ(Owner, SharedOwner),
+      ConstantInt::getAllOnesValue(Type::getInt64Ty(F.getContext())),
+      ConflictBuilder.CreateZExt(
+          ConflictBuilder.CreateSub(Owner, ConstantInt::get(ShadowVarTy, 1)),
+          Type::getInt64Ty(F.getContext())));
+
+  auto *Reported = begin_feature_guard(ConflictBuilder, FeatureReporting, RT);
+
+  add_sanitizer_call(ConflictBuilder, RT.ReportLocalMemoryConflict,
+                     {create_site_id(RT, *Access, "local memory conflict"),
+                      PrevId});
+  end_feature_guard(ConflictBuilder, Reported);
+
+  create_error_exit(ConflictBuilder, TailBlock, RT);
+
+  return {TailBlock, Branch};
+}
+
+// Upper bound (exclusive) of the work-item builtin Call returns, if the
+// launch facts give one
+static std::optional<uint64_t> get_work_item_bound(const CallInst &Call) {
+  const auto *Callee = Call.getCalledFunction();
+  const auto &F = *Call.getFunction();
+
+  if (!Callee) {
+    return std::nullopt;
+  }
+
+  const auto IsKernel = F.getCallingConv() == CallingConv::SPIR_KERNEL;
+
+  if (Callee->getName() == get_local_linear_id_name) {
+    uint64_t Product = 1;
+
+    for (unsigned Dim = 0; Dim < 3; ++Dim) {
+      const auto Size =
+          IsKernel ? get_kernel_size_fact(F, "reqd_work_group_size", Dim)
+                   : std::nullopt;
+
+      if (!Size) {
+        return std::nullopt;
+      }
+
+      Product *= *Size;
+    }
+
+    return Product;
+  }
+
+  const auto IsLocal = Callee->getName() == get_local_id_name;
+
+  if (!IsLocal && Callee->getName() != get_global_id_name) {
+    return std::nullopt;
+  }
+
+  const auto *Dim = dyn_cast<ConstantInt>(Call.getArgOperand(0));
+
+  if (!Dim || Dim->getZExtValue() >= 3) {
+    return std::nullopt;
+  }
+
+  if (IsLocal) {
+    return IsKernel ? get_kernel_size_fact(F, "reqd_work_group_size",
+                                           Dim->getZExtValue())
+                    : std::nullopt;
+  }
+
+  // get_global_id counts from the global work offset, so it is below the
+  // offset plus the global size
+  auto Size = IsKernel ? get_kernel_size_fact(F, "scsan.max_global_size",
+                                              Dim->getZExtValue())
+                       : std::nullopt;
+  auto Offset = IsKernel ? get_kernel_offset_fact(F, Dim->getZExtValue())
+                         : std::nullopt;
+
+  if (!Size && ClMaxGlobalSize) {
+    Size = ClMaxGlobalSize.getValue();
+  }
+
+  if (!Offset && ClMaxGlobalOffset >= 0) {
+    Offset = static_cast<uint64_t>(ClMaxGlobalOffset);
+  }
+
+  if (!Size || !Offset) {
+    return std::nullopt;
+  }
+
+  bool Overflowed = false;
+  const auto Bound = SaturatingAdd(*Size, *Offset, &Overflowed);
+
+  if (Overflowed) {
+    return std::nullopt;
+  }
+
+  return Bound;
+}
+
+// The front end keeps every local variable in an alloca, so at the start of
+// the pipeline an index reaches ScalarEvolution as an opaque load and no
+// loop counter is affine. Promote them, as SROA would right after, so that
+// the proofs, hoisting, redundancy elimination and versioning see through.
+// Functions built with -O0 are left as they are.
+static void promote_allocas(Function &F, DominatorTree &DT,
+                            AssumptionCache &AC) {
+  SmallVector<AllocaInst *, 16> Allocas;
+
+  for (auto &Inst : F.getEntryBlock()) {
+    auto *Alloca = dyn_cast<AllocaInst>(&Inst);
+
+    if (Alloca && isAllocaPromotable(Alloca)) {
+      Allocas.push_back(Alloca);
+    }
+  }
+
+  if (Allocas.empty()) {
+    return;
+  }
+
+  LLVM_DEBUG(dbgs() << "Promoting " << Allocas.size() << " allocas of "
+                    << F.getName() << "\n");
+
+  PromoteMemToReg(Allocas, DT, &AC);
+}
+
+// Marks the !range attached by annotate_work_item_ranges. Loop versioning
+// copies both onto the clones, so the marker finds those too.
+static constexpr char work_item_range_marker[] = "scsan.range";
+
+// Attach !range to the work-item builtins the launch facts bound, so that
+// ScalarEvolution and ValueTracking see them. Must run before either looks
+// at F, so right after instrument_function invalidates its analyses.
+static void annotate_work_item_ranges(Function &F) {
+  for (auto &Inst : instructions(F)) {
+    auto *Call = dyn_cast<CallInst>(&Inst);
+
+    if (!Call || Call->hasMetadata(LLVMContext::MD_range)) {
+      continue;
+    }
+
+    const auto Bound = get_work_item_bound(*Call);
+    auto *Ty = dyn_cast<IntegerType>(Call->getType());
+
+    if (!Bound || !Ty || !isUIntN(Ty->getBitWidth(), *Bound)) {
+      continue;
+    }
+
+    Call->setMetadata(LLVMContext::MD_range,
+                      MDBuilder(F.getContext())
+                          .createRange(APInt(Ty->getBitWidth(), 0),
+                                       APInt(Ty->getBitWidth(), *Bound)));
+    Call->setMetadata(work_item_range_marker, MDNode::get(F.getContext(), {}));
+  }
+}
+
+// Drop the !range annotate_work_item_ranges attached once the proofs are
+// done. The launch facts are only promises to the sanitizer and must not
+// reach the optimizations after it.
+static void strip_work_item_ranges(Function &F) {
+  for (auto &Inst : instructions(F)) {
+    if (Inst.getMetadata(work_item_range_marker)) {
+      Inst.setMetadata(LLVMContext::MD_range, nullptr);
+      Inst.setMetadata(work_item_range_marker, nullptr);
+    }
+  }
+}
+
+// Whether Index < Size holds at CtxI: either a dominating condition or
+// assumption implies it, or the largest possible index is below the
+// smallest possible size
+static bool is_provably_in_bounds(Value *Index, Value *Size,
+                                  const Instruction *CtxI, ScalarEvolution &SE,
+                                  AssumptionCache &AC, DominatorTree &DT) {
+  if (Index->getType() != Size->getType() ||
+      !SE.isSCEVable(Index->getType())) {
+    return false;
+  }
+
+  const auto *IndexSCEV = SE.getSCEV(Index);
+
+  if (SE.isKnownPredicateAt(ICmpInst::ICMP_ULT, IndexSCEV, SE.getSCEV(Size),
+                            CtxI)) {
+    return true;
+  }
+
+  const auto MaxIndex = APIntOps::umin(
+      SE.getUnsignedRangeMax(IndexSCEV),
+      computeConstantRange(Index, false, true, &AC, CtxI, &DT)
+          .getUnsignedMax());
+  const auto MinSize = APIntOps::umax(
+      SE.getUnsignedRangeMin(SE.getSCEV(Size)),
+      computeConstantRange(Size, false, true, &AC, CtxI, &DT)
+          .getUnsignedMin());
+
+  return MaxIndex.ult(MinSize);
+}
+
+// GEPs whose index is proven in bounds. They get no check at all, neither
+// per access nor hoisted out of their loop.
+static SmallPtrSet<const Instruction *, 16>
+prove_in_bounds_geps(Function &F, ScalarEvolution &SE, AssumptionCache &AC,
+                     DominatorTree &DT, OptimizationRemarkEmitter &ORE,
+                     std::vector<ArraySizeLink> &ArraySizeLinks) {
+  SmallPtrSet<const Instruction *, 16> Proven;
+
+  for (auto &Block : F) {
+    for (auto Inst = Block.begin(), E = Block.end(); Inst != E; ++Inst) {
+      const auto *GetElementPtr = dyn_cast<GetElementPtrInst>(Inst);
+
+      if (!GetElementPtr) {
+        continue;
+      }
+
+      const auto MaybeGEPPair =
+          find_injectable_gep(ArraySizeLinks, Inst, GetElementPtr);
+
+      if (!MaybeGEPPair) {
+        continue;
+      }
+
+      const auto *Link =
+          find_array_size_link(ArraySizeLinks, MaybeGEPPair->second);
+
+      if (!Link || !is_provably_in_bounds(GetElementPtr->getOperand(1),
+                                          Link->SizeArg, GetElementPtr, SE, AC,
+                                          DT)) {
+        continue;
+      }
+
+      Proven.insert(GetElementPtr);
+
+      ++NumProvenChecks;
+
+      ORE.emit([&] {
+        return OptimizationRemark(DEBUG_TYPE, "BoundsCheckProven",
+                                  GetElementPtr)
+               << "bounds check of " << ore::NV("Array", Link->ArrayArg)
+               << " elided: index proven smaller than "
+               << ore::NV("Size", Link->SizeArg);
+      });
+    }
+  }
+
+  return Proven;
+}
+
+struct LoopBoundsCheck {
+  const Instruction *Access;
+  const SCEV *MaxIndex;
+  Argument *SizeArg;
+  // Iterations that run the access when that may be none, in which case
+  // MaxIndex means nothing and the check passes
+  const SCEV *Runs;
+};
+
+struct LoopCheckSite {
+  BasicBlock *Preheader;
+  BasicBlock *Header;
+  SmallVector<LoopBoundsCheck, 4> Checks;
+};
+
+struct LoopCheckPlan {
+  // GEPs whose whole index range is checked before their loop
+  SmallPtrSet<const Instruction *, 16> HoistedGEPs;
+  // GEPs of the unchecked copies of versioned loops
+  SmallPtrSet<const Instruction *, 16> VersionedGEPs;
+  MapVector<const Loop *, LoopCheckSite> Sites;
+};
+
+// -scsan-version-loops: an innermost loop whose accesses all have a
+// computable index range, although not one that may be reported up front
+struct LoopVersion {
+  Loop *L;
+  SmallVector<LoopBoundsCheck, 4> Checks;
+};
+
+// Whether a loop only leaves at the header, as loops do before rotation.
+// Its other blocks never run in the last iteration.
+static bool exits_at_header(const BasicBlock *Block, const Loop *L) {
+  return Block != L->getHeader() && L->getExitingBlock() == L->getHeader();
+}
+
+// Whether Block runs once per loop iteration it can run in. This holds when
+// it dominates the latch and every exiting block, or only the latch of a
+// loop that exits at the header.
+static bool runs_on_every_iteration(const BasicBlock *Block, const Loop *L,
+                                    const DominatorTree &DT) {
+  const auto *Latch = L->getLoopLatch();
+
+  if (!Latch || !DT.dominates(Block, Latch)) {
+    return false;
+  }
+
+  if (exits_at_header(Block, L)) {
+    return true;
+  }
+
+  SmallVector<BasicBlock *, 4> ExitingBlocks;
+  L->getExitingBlocks(ExitingBlocks);
+
+  return !ExitingBlocks.empty() &&
+         std::all_of(ExitingBlocks.begin(), ExitingBlocks.end(),
+                     [&](const BasicBlock *Exiting) {
+                       return DT.dominates(Block, Exiting);
+                     });
+}
+
+// Largest (unsigned) value Index takes over all iterations of L, or all but
+// the last one, or nullptr if it cannot be computed before the loop.
+static const SCEV *get_loop_max_index(ScalarEvolution &SE, const Loop *L,
+                                      const SCEV *Index, bool SkipsLast) {
+  if (SE.isLoopInvariant(Index, L)) {
+    return Index;
+  }
+
+  const auto *AddRec = dyn_cast<SCEVAddRecExpr>(Index);
+
+  if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine()) {
+    return nullptr;
+  }
+
+  // Without wrapping the values stay between the first and the last one
+  if (!AddRec->hasNoUnsignedWrap() && !AddRec->hasNoSignedWrap()) {
+    return nullptr;
+  }
+
+  const auto *BackedgeTakenCount = SE.getBackedgeTakenCount(L);
+
+  if (isa<SCEVCouldNotCompute>(BackedgeTakenCount) ||
+      SE.getTypeSizeInBits(BackedgeTakenCount->getType()) >
+          SE.getTypeSizeInBits(AddRec->getType())) {
+    return nullptr;
+  }
+
+  auto *Iterations =
+      SE.getNoopOrZeroExtend(BackedgeTakenCount, AddRec->getType());
+
+  if (SkipsLast) {
+    Iterations =
+        SE.getMinusSCEV(Iterations, SE.getOne(Iterations->getType()));
+  }
+
+  const auto *Last = AddRec->evaluateAtIteration(Iterations, SE);
+
+  return SE.getUMaxExpr(AddRec->getStart(), Last);
+}
+
+// Largest index of an access in Block over the iterations of L that can run
+// it. In a loop that exits at the header Runs is set to their number, as
+// the access does not run at all when it is 0.
+static const SCEV *get_access_max_index(ScalarEvolution &SE, const Loop *L,
+                                        const BasicBlock *Block,
+                                        const SCEV *Index, const SCEV *&Runs) {
+  Runs = nullptr;
+
+  if (!exits_at_header(Block, L)) {
+    return get_loop_max_index(SE, L, Index, false);
+  }
+
+  const auto *BackedgeTakenCount = SE.getBackedgeTakenCount(L);
+
+  if (isa<SCEVCouldNotCompute>(BackedgeTakenCount)) {
+    return nullptr;
+  }
+
+  Runs = BackedgeTakenCount;
+
+  return get_loop_max_index(SE, L, Index, true);
+}
+
+static LoopCheckPlan
+plan_loop_checks(Function &F, LoopInfo &LI, DominatorTree &DT,
+                 ScalarEvolution &SE,
+                 std::vector<ArraySizeLink> &ArraySizeLinks,
+                 const SmallPtrSetImpl<const Instruction *> &ProvenGEPs,
+                 OptimizationRemarkEmitter &ORE) {
+  LoopCheckPlan Plan;
+  SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "scsan.range");
+
+  for (auto &Block : F) {
+    const auto *L = LI.getLoopFor(&Block);
+
+    if (!L) {
+      continue;
+    }
+
+    auto *Preheader = L->getLoopPreheader();
+
+    if (!Preheader || !runs_on_every_iteration(&Block, L, DT)) {
+      continue;
+    }
+
+    for (auto Inst = Block.begin(), E = Block.end(); Inst != E; ++Inst) {
+      const auto *GetElementPtr = dyn_cast<GetElementPtrInst>(Inst);
+
+      if (!GetElementPtr || ProvenGEPs.contains(GetElementPtr)) {
+        continue;
+      }
+
+      const auto MaybeGEPPair =
+          find_injectable_gep(ArraySizeLinks, Inst, GetElementPtr);
+
+      if (!MaybeGEPPair) {
+        continue;
+      }
+
+      const auto *Link =
+          find_array_size_link(ArraySizeLinks, MaybeGEPPair->second);
+      auto *IndexOperand = GetElementPtr->getOperand(1);
+
+      if (!Link || IndexOperand->getType() != Link->SizeArg->getType() ||
+          !SE.isSCEVable(IndexOperand->getType())) {
+        continue;
+      }
+
+      const SCEV *Runs = nullptr;
+      const auto *MaxIndex = get_access_max_index(
+          SE, L, &Block, SE.getSCEV(IndexOperand), Runs);
+
+      if (!MaxIndex ||
+          !Expander.isSafeToExpandAt(MaxIndex, Preheader->getTerminator()) ||
+          (Runs &&
+           !Expander.isSafeToExpandAt(Runs, Preheader->getTerminator()))) {
+        ORE.emit([&] {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "BoundsCheckNotHoisted",
+                                          GetElementPtr)
+                 << "bounds check of " << ore::NV("Array", Link->ArrayArg)
+                 << " kept in the loop: index range not computable";
+        });
+
+        continue;
+      }
+
+      ORE.emit([&] {
+        return OptimizationRemark(DEBUG_TYPE, "BoundsCheckHoisted",
+                                  GetElementPtr)
+               << "bounds check of " << ore::NV("Array", Link->ArrayArg)
+               << " hoisted out of the loop";
+      });
+
+      ++NumHoistedChecks;
+
+      auto &Site = Plan.Sites[L];
+      Site.Preheader = Preheader;
+      Site.Header = L->getHeader();
+      Site.Checks.push_back({GetElementPtr, MaxIndex, Link->SizeArg, Runs});
+
+      Plan.HoistedGEPs.insert(GetElementPtr);
+    }
+  }
+
+  return Plan;
+}
+
+// One branch per loop: all ranges are and-ed together in front of the
+// preheader's terminator
+static Value *create_loop_range_test(IRBuilder<> &Builder,
+                                     SCEVExpander &Expander,
+                                     ArrayRef<LoopBoundsCheck> Checks) {
+  auto *Terminator = &*Builder.GetInsertPoint();
+  Value *InBounds = nullptr;
+
+  for (const auto &Check : Checks) {
+    auto *MaxIndex = Expander.expandCodeFor(
+        Check.MaxIndex, Check.SizeArg->getType(), Terminator);
+    Value *Cond = Builder.CreateICmpULT(MaxIndex, Check.SizeArg);
+
+    // A select, as MaxIndex may wrap to poison when there is no iteration
+    if (Check.Runs) {
+      auto *Runs = Expander.expandCodeFor(Check.Runs, Check.Runs->getType(),
+                                          Terminator);
+
+      Cond = Builder.CreateSelect(Builder.CreateIsNull(Runs),
+                                  Builder.getTrue(), Cond);
+    }
+
+    InBounds = InBounds ? Builder.CreateAnd(InBounds, Cond) : Cond;
+  }
+
+  return InBounds;
+}
+
+static void inject_loop_checks(Function &F, ScalarEvolution &SE,
+                               const LoopCheckPlan &Plan, Value *BoundsEnabled,
+                               SanitizerRuntime &RT) {
+  SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "scsan.range");
+
+  for (const auto &[L, Site] : Plan.Sites) {
+    auto *Terminator = Site.Preheader->getTerminator();
+
+    IRBuilder<> Builder(Terminator);
+
+    auto *InBounds = create_loop_range_test(Builder, Expander, Site.Checks);
+
+    auto *ThenBlock =
+        split_block_at(F, *Site.Preheader, Terminator->getIterator());
+    // Reported as the first access of the loop
+    auto *ElseBlock = create_index_out_of_bounds_block(
+        F, RT, *Site.Checks.front().Access, ThenBlock);
+
+    Builder.SetInsertPoint(Site.Preheader);
+    Builder.CreateCondBr(guard_bounds_check(Builder, InBounds, BoundsEnabled),
+                         ThenBlock, ElseBlock);
+  }
+}
+
+struct BoundsCheckCache {
+  // GEPs covered by a dominating check on the same array
+  SmallPtrSet<const Instruction *, 16> ElidedGEPs;
+  // Index to compare instead of the GEP's own index, after later checks of
+  // the same block were merged into it
+  DenseMap<const Instruction *, Value *> MergedIndices;
+};
+
+// Walks the dominator tree keeping the (array, index) pairs already checked
+// on every path to the current block. A check whose index is provably not
+// larger than one of them is dropped. A check that follows another check of
+// the same array in the same block is folded into it as umax(a, b) < size.
+static BoundsCheckCache
+build_check_cache(Function &F, DominatorTree &DT, ScalarEvolution &SE,
+                  std::vector<ArraySizeLink> &ArraySizeLinks,
+                  const LoopCheckPlan &LoopChecks,
+                  const SmallPtrSetImpl<const Instruction *> &ProvenGEPs,
+                  OptimizationRemarkEmitter &ORE) {
+  BoundsCheckCache Cache;
+  SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "scsan.merged");
+
+  DenseMap<const ArraySizeLink *, SmallVector<const SCEV *, 4>> Checked;
+  SmallVector<const ArraySizeLink *, 32> CheckedLog;
+  MapVector<Instruction *, const SCEV *> MergedMax;
+
+  // Second element: log size to roll back to once the subtree is done
+  SmallVector<std::pair<DomTreeNode *, std::optional<size_t>>, 32> Worklist;
+  Worklist.push_back({DT.getRootNode(), std::nullopt});
+
+  while (!Worklist.empty()) {
+    auto [Node, RollbackTo] = Worklist.pop_back_val();
+
+    if (RollbackTo) {
+      while (CheckedLog.size() > *RollbackTo) {
+        Checked[CheckedLog.pop_back_val()].pop_back();
+      }
+
+      continue;
+    }
+
+    Worklist.push_back({Node, CheckedLog.size()});
+
+    for (auto *Child : Node->children()) {
+      Worklist.push_back({Child, std::nullopt});
+    }
+
+    // Last kept check of each array in this block, for merging
+    SmallDenseMap<const ArraySizeLink *, Instruction *, 4> BlockChecks;
+
+    for (auto &Inst : *Node->getBlock()) {
+      auto *GetElementPtr = dyn_cast<GetElementPtrInst>(&Inst);
+
+      if (!GetElementPtr) {
+        continue;
+      }
+
+      const auto MaybeGEPPair = find_injectable_gep(
+          ArraySizeLinks, GetElementPtr->getIterator(), GetElementPtr);
+
+      if (!MaybeGEPPair) {
+        continue;
+      }
+
+      const auto *Link =
+          find_array_size_link(ArraySizeLinks, MaybeGEPPair->second);
+      auto *IndexOperand = GetElementPtr->getOperand(1);
+
+      if (!Link || IndexOperand->getType() != Link->SizeArg->getType() ||
+          !SE.isSCEVable(IndexOperand->getType())) {
+        continue;
+      }
+
+      const auto *Index = SE.getSCEV(IndexOperand);
+      auto &Dominating = Checked[Link];
+
+      // A proven index covers later ones like a check would, but nothing
+      // can be merged into it
+      if (ProvenGEPs.contains(GetElementPtr)) {
+        Dominating.push_back(Index);
+        CheckedLog.push_back(Link);
+
+        continue;
+      }
+
+      const auto IsCovered = std::any_of(
+          Dominating.rbegin(),
+          Dominating.rbegin() +
+              std::min<size_t>(Dominating.size(), MaxDominatingChecks),
+          [&](const SCEV *Prev) {
+            return SE.isKnownPredicate(ICmpInst::ICMP_ULE, Index, Prev);
+          });
+
+      if (IsCovered) {
+        ORE.emit([&] {
+          return OptimizationRemark(DEBUG_TYPE, "BoundsCheckElided",
+                                    GetElementPtr)
+                 << "bounds check of " << ore::NV("Array", Link->ArrayArg)
+                 << " covered by a dominating check";
+        });
+
+        ++NumDominatedChecks;
+
+        Cache.ElidedGEPs.insert(GetElementPtr);
+
+        continue;
+      }
+
+      const auto IsHoisted = LoopChecks.HoistedGEPs.contains(GetElementPtr);
+      auto *Prev = BlockChecks.lookup(Link);
+
+      if (!IsHoisted && Prev &&
+          isGuaranteedToTransferExecutionToSuccessor(Prev->getIterator(),
+                                                     Inst.getIterator()) &&
+          Expander.isSafeToExpandAt(Index, Prev)) {
+        ORE.emit([&] {
+          return OptimizationRemark(DEBUG_TYPE, "BoundsCheckMerged",
+                                    GetElementPtr)
+                 << "bounds check of " << ore::NV("Array", Link->ArrayArg)
+                 << " merged into an earlier check of the block";
+        });
+
+        ++NumMergedChecks;
+
+        auto &Max = MergedMax[Prev];
+        Max = SE.getUMaxExpr(Max ? Max : SE.getSCEV(Prev->getOperand(1)),
+                             Index);
+
+        Cache.ElidedGEPs.insert(GetElementPtr);
+      } else if (!IsHoisted) {
+        BlockChecks[Link] = GetElementPtr;
+      }
+
+      Dominating.push_back(Index);
+      CheckedLog.push_back(Link);
+    }
+  }
+
+  for (auto &[Inst, Max] : MergedMax) {
+    Cache.MergedIndices[Inst] =
+        Expander.expandCodeFor(Max, Max->getType(), Inst);
+  }
+
+  return Cache;
+}
+
+struct InstrumentationTargets {
+  SmallVector<std::pair<BasicBlock::iterator, Argument *>, 16> GEPs;
+  SmallVector<RangeAccess, 16> Ranges;
+  SmallVector<std::pair<BasicBlock::iterator, const ShadowLocalMemLink *>, 16>
+      LocalAccesses;
+};
+
+// Phase 1: a single walk in reverse post-order that only collects the
+// instructions to check. Nothing is modified, so every block and
+// instruction is looked at exactly once.
+static InstrumentationTargets collect_instrumentation_targets(
+    Function &F, const std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks,
+    std::vector<ArraySizeLink> &ArraySizeLinks, const LoopCheckPlan &LoopChecks,
+    const BoundsCheckCache &CheckCache,
+    const SmallPtrSetImpl<const Instruction *> &ProvenGEPs) {
+  InstrumentationTargets Targets;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+
+  for (auto *Block : RPOT) {
+    for (auto Inst = Block->begin(), E = Block->end(); Inst != E; ++Inst) {
+      // ArrayIndexOutOfBounds: Intercept GEP
+      if (const auto *GetElementPtr = dyn_cast<GetElementPtrInst>(Inst)) {
+        if (ProvenGEPs.contains(GetElementPtr)) {
+          continue; // Proven in bounds
+        }
+
+        if (LoopChecks.HoistedGEPs.contains(GetElementPtr) ||
+            LoopChecks.VersionedGEPs.contains(GetElementPtr)) {
+          continue; // Checked in the loop preheader
+        }
+
+        if (CheckCache.ElidedGEPs.contains(GetElementPtr)) {
+          continue; // Covered by another check
+        }
+
+        if (auto MaybeGEPPair =
+                find_injectable_gep(ArraySizeLinks, Inst, GetElementPtr)) {
+          LLVM_DEBUG(dbgs() << "Found injectable GEP instruction: " << *Inst
+                            << "\n");
+
+          Targets.GEPs.push_back(*MaybeGEPPair);
+        }
+
+        continue;
+      }
+
+      // ArrayIndexOutOfBounds: Intercept wide and nested accesses
+      if (auto MaybeRange = find_range_access(ArraySizeLinks, Inst)) {
+        LLVM_DEBUG(dbgs() << "Found range access: " << *Inst << "\n");
+
+        Targets.Ranges.push_back(*MaybeRange);
+      }
+
+      // LocalMemoryConflict: Intercept loads and stores
+      if (isa<LoadInst, StoreInst>(Inst)) {
+        if (auto MaybeShadowVarPair = find_injectable_local_mem_access(
+                ShadowLocalMemLinks, Inst, &*Inst)) {
+          LLVM_DEBUG(dbgs() << "Found access to local memory: " << *Inst
+                            << "\n");
+
+          Targets.LocalAccesses.push_back(*MaybeShadowVarPair);
+        }
+      }
+    }
+  }
+
+  return Targets;
+}
+
+// Whether execution goes on from From to To. Unlike
+// isGuaranteedToTransferExecutionToSuccessor, this knows that the vector
+// builtins return.
+static bool reaches(BasicBlock::iterator From, BasicBlock::iterator To) {
+  for (; From != To; ++From) {
+    bool IsStore;
+
+    if (const auto *Call = dyn_cast<CallInst>(From);
+        Call && get_vector_builtin_width(*Call, IsStore)) {
+      continue;
+    }
+
+    if (!isGuaranteedToTransferExecutionToSuccessor(&*From)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static const SCEV *get_range_address(ScalarEvolution &SE,
+                                     const RangeAccess &Range) {
+  const auto *Address = SE.getSCEV(Range.Ptr);
+
+  if (!Range.VectorOffset) {
+    return Address;
+  }
+
+  auto *IntPtrTy = SE.getEffectiveSCEVType(Range.Ptr->getType());
+
+  return SE.getAddExpr(
+      Address,
+      SE.getMulExpr(SE.getTruncateOrZeroExtend(
+                        SE.getSCEV(Range.VectorOffset), IntPtrTy),
+                    SE.getConstant(IntPtrTy, Range.VectorBytes)));
+}
+
+// Folds an access into an earlier one of the same block and array when it
+// starts a constant number of bytes after it, e.g. the lanes of an unrolled
+// loop. The earlier check then covers both as one longer range.
+static void merge_range_accesses(SmallVectorImpl<RangeAccess> &Ranges,
+                                 ScalarEvolution &SE,
+                                 OptimizationRemarkEmitter &ORE) {
+  SmallVector<RangeAccess, 16> Merged;
+  // Open range of each array, as an index into Merged
+  SmallDenseMap<const Argument *, size_t, 4> Open;
+  std::optional<BasicBlock::iterator> Cursor;
+
+  for (const auto &Range : Ranges) {
+    if (!Cursor || (*Cursor)->getParent() != Range.Inst->getParent() ||
+        !reaches(*Cursor, Range.Inst)) {
+      Open.clear();
+    }
+
+    Cursor = Range.Inst;
+
+    if (const auto It = Open.find(Range.ArrayArg); It != Open.end()) {
+      auto &Leader = Merged[It->second];
+      const auto *Distance = dyn_cast<SCEVConstant>(SE.getMinusSCEV(
+          get_range_address(SE, Range), get_range_address(SE, Leader)));
+
+      if (Leader.ElemBytes == Range.ElemBytes && Distance &&
+          !Distance->getAPInt().isNegative()) {
+        ORE.emit([&] {
+          return OptimizationRemark(DEBUG_TYPE, "BoundsCheckMerged",
+                                    &*Range.Inst)
+                 << "range check of " << ore::NV("Array", Range.ArrayArg)
+                 << " merged into an earlier access of the block";
+        });
+
+        ++NumMergedChecks;
+
+        Leader.AccessBytes =
+            std::max(Leader.AccessBytes,
+                     Distance->getAPInt().getZExtValue() + Range.AccessBytes);
+
+        continue;
+      }
+    }
+
+    Open[Range.ArrayArg] = Merged.size();
+    Merged.push_back(Range);
+  }
+
+  Ranges.assign(Merged.begin(), Merged.end());
+}
+
+// Phase 2: split blocks in front of every collected instruction. Each check
+// works on the block the instruction lives in at that point, so earlier
+// splits do not need to be revisited.
+static void inject_checks(Function &F, const InstrumentationTargets &Targets,
+                          std::vector<ArraySizeLink> &ArraySizeLinks,
+                          const BoundsCheckCache &CheckCache,
+                          Value *BoundsEnabled, SanitizerRuntime &RT) {
+  // Local linear id + 1 as a shadow cell and the epoch slot, computed once
+  // at entry and shared by every access
+  Value *LocalTag = nullptr;
+  Value *EpochPtr = nullptr;
+
+  if (!Targets.LocalAccesses.empty()) {
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+
+    auto *LocalId = create_local_linear_id(EntryBuilder, F);
+
+    LocalTag = EntryBuilder.CreateAdd(
+        EntryBuilder.CreateTrunc(LocalId, RT.ShadowCellTy),
+        ConstantInt::get(RT.ShadowCellTy, 1));
+    EpochPtr = EntryBuilder.CreateInBoundsGEP(
+        RT.ShadowEpochs->getValueType(), RT.ShadowEpochs,
+        {ConstantInt::get(LocalId->getType(), 0), LocalId});
+  }
+
+  for (const auto &ShadowVarPair : Targets.LocalAccesses) {
+    auto &Block = *ShadowVarPair.first->getParent();
+    IRBuilder<> Builder(&Block);
+
+    inject_shadow_local_mem_check(F, Block, Builder, ShadowVarPair, LocalTag,
+                                  EpochPtr, RT);
+  }
+
+  for (const auto &GEPPair : Targets.GEPs) {
+    auto *GetElementPtr = &*GEPPair.first;
+    auto *IndexOperand = CheckCache.MergedIndices.lookup(GetElementPtr);
+
+    auto &Block = *GetElementPtr->getParent();
+    IRBuilder<> Builder(&Block);
+
+    inject_gep_check(F, Block, Builder, ArraySizeLinks, GEPPair,
+                     IndexOperand ? IndexOperand : GetElementPtr->getOperand(1),
+                     BoundsEnabled, RT);
+  }
+
+  for (const auto &Range : Targets.Ranges) {
+    auto &Block = *Range.Inst->getParent();
+    IRBuilder<> Builder(&Block);
+
+    inject_range_check(F, Block, Builder, ArraySizeLinks, Range, BoundsEnabled,
+                       RT);
+  }
+}
+
+static std::vector<ArraySizeLink>
+find_array_size_links(Function &F, const SanitizerRuntime &RT) {
+  if (const auto It = RT.PropagatedLinks.find(&F);
+      It != RT.PropagatedLinks.end()) {
+    return It->second;
+  }
+
+  std::vector<ArraySizeLink> ret;
+
+  std::optional<size_t> FoundArraySizeLink;
+  for (auto &Arg : F.args()) {
+    if (Arg.getType()->isPointerTy()) {
+      if (FoundArraySizeLink) {
+        FoundArraySizeLink.reset();
+      }
+
+      FoundArraySizeLink = Arg.getArgNo();
+    }
+
+    if (Arg.getType()->isIntegerTy()) {
+      if (Arg.getType()->getIntegerBitWidth() == 64) {
+        if (FoundArraySizeLink) {
+          ret.push_back({F.getArg(FoundArraySizeLink.value()), &Arg});
+
+          FoundArraySizeLink.reset();
+        }
+      }
+    }
+  }
+
+  return ret;
+}
+
+// Size argument of the linked array Actual refers to in Caller, if any
+static Argument *find_linked_size(Value *Actual, Function &Caller,
+                                  const SanitizerRuntime &RT) {
+  auto *ArrayArg = Actual->getType()->isPointerTy()
+                       ? find_array_argument(Actual->stripPointerCasts())
+                       : nullptr;
+
+  if (!ArrayArg) {
+    return nullptr;
+  }
+
+  const auto Links = find_array_size_links(Caller, RT);
+  const auto *Link = find_array_size_link(Links, ArrayArg);
+
+  return Link ? Link->SizeArg : nullptr;
+}
+
+// Copy Helper with one trailing i64 per parameter in ArrayArgNos, the size
+// of the array passed there
+static Function *create_sized_helper(Function &Helper,
+                                     ArrayRef<unsigned> ArrayArgNos,
+                                     SanitizerRuntime &RT) {
+  auto *Int64Ty = Type::getInt64Ty(Helper.getContext());
+  SmallVector<Type *, 8> Params(Helper.getFunctionType()->param_begin(),
+                                Helper.getFunctionType()->param_end());
+
+  Params.append(ArrayArgNos.size(), Int64Ty);
+
+  auto *Clone = Function::Create(
+      FunctionType::get(Helper.getReturnType(), Params, false),
+      GlobalValue::InternalLinkage, Helper.getAddressSpace(),
+      Helper.getName() + ".sized", Helper.getParent());
+  ValueToValueMapTy VMap;
+
+  for (auto &Arg : Helper.args()) {
+    auto *NewArg = Clone->getArg(Arg.getArgNo());
+
+    NewArg->setName(Arg.getName());
+    VMap[&Arg] = NewArg;
+  }
+
+  SmallVector<ReturnInst *, 4> Returns;
+
+  CloneFunctionInto(Clone, &Helper, VMap,
+                    CloneFunctionChangeType::LocalChangesOnly, Returns);
+  Clone->setCallingConv(Helper.getCallingConv());
+
+  // The links the helper already had, then the new ones
+  auto &Links = RT.PropagatedLinks[Clone];
+
+  for (const auto &Link : find_array_size_links(Helper, RT)) {
+    Links.push_back({Clone->getArg(Link.ArrayArg->getArgNo()),
+                     Clone->getArg(Link.SizeArg->getArgNo())});
+  }
+
+  for (unsigned I = 0; I < ArrayArgNos.size(); ++I) {
+    auto *SizeArg = Clone->getArg(Helper.arg_size() + I);
+
+    SizeArg->setName(Helper.getArg(ArrayArgNos[I])->getName() + ".size");
+    Links.push_back({Clone->getArg(ArrayArgNos[I]), SizeArg});
+  }
+
+  return Clone;
+}
+
+// Pass array sizes down to helpers that only receive the pointer. When every
+// call of a helper passes a linked array (or the front end's reload of one)
+// for a pointer parameter, the calls are redirected to a copy of the helper
+// that takes the size as a hidden argument. Helpers are visited once all
+// their callers are, so sizes flow down call chains; recursive helpers and
+// helpers whose address is taken keep their signature.
+static void propagate_array_sizes(Module &M, SanitizerRuntime &RT) {
+  // Functions whose calls are final, and originals no call reaches any more
+  SmallPtrSet<const Function *, 16> Visited;
+  SmallPtrSet<const Function *, 16> Superseded;
+  SmallVector<Function *, 16> Pending;
+
+  for (auto &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+
+    if (F.getCallingConv() == CallingConv::SPIR_KERNEL || F.isVarArg()) {
+      Visited.insert(&F);
+    } else {
+      Pending.push_back(&F);
+    }
+  }
+
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+
+    for (auto *Helper : make_early_inc_range(Pending)) {
+      SmallVector<CallInst *, 8> Calls;
+      bool Ready = true;
+      bool AddressTaken = false;
+
+      for (auto *U : Helper->users()) {
+        auto *Call = dyn_cast<CallInst>(U);
+
+        if (!Call || Call->getCalledFunction() != Helper) {
+          AddressTaken = true;
+        } else if (!Superseded.contains(Call->getFunction())) {
+          Ready &= Visited.contains(Call->getFunction());
+          Calls.push_back(Call);
+        }
+      }
+
+      if (!Ready && !AddressTaken) {
+        continue;
+      }
+
+      Visited.insert(Helper);
+      Changed = true;
+
+      if (AddressTaken || Calls.empty()) {
+        continue;
+      }
+
+      const auto Links = find_array_size_links(*Helper, RT);
+      SmallVector<unsigned, 4> ArrayArgNos;
+
+      for (auto &Arg : Helper->args()) {
+        if (!Arg.getType()->isPointerTy() ||
+            find_array_size_link(Links, &Arg)) {
+          continue;
+        }
+
+        if (all_of(Calls, [&](CallInst *Call) {
+              return find_linked_size(Call->getArgOperand(Arg.getArgNo()),
+                                      *Call->getFunction(), RT);
+            })) {
+          ArrayArgNos.push_back(Arg.getArgNo());
+        }
+      }
+
+      if (ArrayArgNos.empty()) {
+        continue;
+      }
+
+      auto *Clone = create_sized_helper(*Helper, ArrayArgNos, RT);
+
+      for (auto *Call : Calls) {
+        SmallVector<Value *, 8> Args(Call->args());
+
+        for (const auto ArgNo : ArrayArgNos) {
+          Args.push_back(find_linked_size(Call->getArgOperand(ArgNo),
+                                          *Call->getFunction(), RT));
+        }
+
+        IRBuilder<> Builder(Call);
+
+        auto *NewCall = Builder.CreateCall(Clone, Args);
+
+        NewCall->setCallingConv(Call->getCallingConv());
+        NewCall->setAttributes(Call->getAttributes());
+        NewCall->setDebugLoc(Call->getDebugLoc());
+        NewCall->takeName(Call);
+        Call->replaceAllUsesWith(NewCall);
+        Call->eraseFromParent();
+      }
+
+      NumPropagatedSizes += ArrayArgNos.size();
+
+      LLVM_DEBUG(dbgs() << "Passing " << ArrayArgNos.size()
+                        << " array sizes on to " << Clone->getName() << "\n");
+
+      OptimizationRemarkEmitter ORE(Clone);
+
+      ORE.emit([&] {
+        return OptimizationRemark(DEBUG_TYPE, "ArraySizePropagated",
+                                  Clone->getSubprogram(),
+                                  &Clone->getEntryBlock())
+               << ore::NV("Function", Helper) << " receives the size of "
+               << ore::NV("Arrays", unsigned(ArrayArgNos.size()))
+               << " arrays from its callers";
+      });
+
+      Visited.insert(Clone);
+
+      if (Helper->use_empty()) {
+        Superseded.insert(Helper);
+      }
+    }
+
+    erase_if(Pending, [&](Function *F) { return Visited.contains(F); });
+  }
+
+  // Other modules may still call the originals that are visible to them
+  for (auto *Helper : Superseded) {
+    if (Helper->hasLocalLinkage()) {
+      const_cast<Function *>(Helper)->eraseFromParent();
+    }
+  }
+}
+
+// Largest work-group any kernel of M runs with: the biggest
+// reqd_work_group_size when every kernel declares one, the command line
+// bound otherwise
+static uint64_t get_max_work_group_size(const Module &M) {
+  uint64_t Max = 0;
+
+  for (const auto &F : M) {
+    if (F.isDeclaration() || F.getCallingConv() != CallingConv::SPIR_KERNEL) {
+      continue;
+    }
+
+    const auto Size = get_reqd_work_group_size(F);
+
+    if (!Size) {
+      return ClMaxWorkGroupSize;
+    }
+
+    Max = std::max(Max, *Size);
+  }
+
+  return Max ? Max : uint64_t(ClMaxWorkGroupSize);
+}
+
+static unsigned get_shadow_owner_bits(uint64_t MaxWorkGroupSize) {
+  return Log2_64_Ceil(MaxWorkGroupSize + 2);
+}
+
+// Cells store an epoch and a read bit above the owner. 16 bits are used when
+// they leave room for at least MinEpochBits of epoch.
+static IntegerType *get_shadow_cell_type(LLVMContext &Ctx,
+                                         uint64_t MaxWorkGroupSize) {
+  if (get_shadow_owner_bits(MaxWorkGroupSize) + 1 + MinEpochBits <= 16) {
+    return Type::getInt16Ty(Ctx);
+  }
+
+  return Type::getInt32Ty(Ctx);
+}
+
+// Whether F refers to Var, directly or through constant expressions
+static bool is_used_in(const GlobalVariable &Var, const Function &F) {
+  SmallVector<const User *, 8> Worklist(Var.user_begin(), Var.user_end());
+
+  while (!Worklist.empty()) {
+    const auto *U = Worklist.pop_back_val();
+
+    if (const auto *Inst = dyn_cast<Instruction>(U)) {
+      if (Inst->getFunction() == &F) {
+        return true;
+      }
+    } else if (isa<ConstantExpr>(U)) {
+      Worklist.append(U->user_begin(), U->user_end());
+    }
+  }
+
+  return false;
+}
+
+static GlobalVariable *create_local_var(Module &M, Type *Ty, StringRef Name,
+                                        Align Alignment) {
+  auto *Var = new GlobalVariable(M, Ty, false, GlobalValue::InternalLinkage,
+                                 UndefValue::get(Ty), Name, nullptr,
+                                 GlobalValue::NotThreadLocal,
+                                 LocalAddressSpace, false);
+  Var->setAlignment(Alignment);
+
+  return Var;
+}
+
+static std::vector<ShadowLocalMemLink>
+find_shadow_local_mem_links(Module &M, IntegerType *CellTy) {
+  std::vector<ShadowLocalMemLink> ret;
+  const auto &DL = M.getDataLayout();
+
+  SmallVector<GlobalVariable *, 8> LocalArrays;
+
+  for (auto &Var : M.globals()) {
+    if (Var.getType()->getAddressSpace() != LocalAddressSpace) {
+      LLVM_DEBUG(dbgs() << "Skipping global variable without addrspace(3): "
+                        << Var << "\n");
+
+      continue;
+    }
+
+    if (Var.isConstant()) {
+      LLVM_DEBUG(dbgs() << "Skipping constant global variable: " << Var
+                        << "\n");
+
+      continue;
+    }
+
+    if (Var.isExternallyInitialized()) {
+      LLVM_DEBUG(dbgs() << "Skipping external global variable: " << Var
+                        << "\n");
+
+      continue;
+    }
+
+    // Var is array?
+    if (!Var.getValueType()->isArrayTy()) {
+      LLVM_DEBUG(dbgs() << "Skipping global variable that is not an array: "
+                        << Var << "\n");
+
+      continue;
+    }
+
+    LLVM_DEBUG(dbgs() << "Found local array buffer: " << Var << "\n");
+
+    LocalArrays.push_back(&Var);
+  }
+
+  for (auto *Var : LocalArrays) {
+    auto *ArrayTy = Var->getValueType();
+    const auto ArrayBytes = DL.getTypeAllocSize(ArrayTy).getFixedValue();
+    const auto Granularity =
+        ClShadowGranularity
+            ? uint64_t(ClShadowGranularity)
+            : DL.getTypeAllocSize(ArrayTy->getArrayElementType())
+                  .getFixedValue();
+    auto NumCells = divideCeil(ArrayBytes, Granularity);
+    // A 16-bit cell shares its word with a neighbour, so a store private to
+    // its work-item cannot be stamped without a compare-exchange. Such arrays
+    // get 32-bit cells; the epoch and owner keep the same bits.
+    auto *LinkCellTy = CellTy;
+
+    if (CellTy->getIntegerBitWidth() == 16 &&
+        has_private_local_stores(*Var, Granularity)) {
+      LinkCellTy = Type::getInt32Ty(M.getContext());
+    }
+
+    // Keep the shadow a whole number of 32-bit words for the runtime
+    if (LinkCellTy->getIntegerBitWidth() == 16) {
+      NumCells = alignTo(NumCells, 2);
+    }
+
+    ret.push_back({nullptr, Var, Granularity,
+                   ArrayType::get(LinkCellTy, NumCells), std::nullopt});
+  }
+
+  return ret;
+}
+
+// Bytes of local memory kernel F takes once instrumented: its own local
+// variables, the shadow bookkeeping and the shadows that stay local
+static uint64_t get_local_footprint(const Function &F,
+                                    const SanitizerRuntime &RT) {
+  const auto &M = *F.getParent();
+  const auto &DL = M.getDataLayout();
+  uint64_t Footprint =
+      DL.getTypeAllocSize(RT.ShadowEpochs->getValueType()).getFixedValue();
+
+  for (const auto &Var : M.globals()) {
+    if (Var.getAddressSpace() == LocalAddressSpace && is_used_in(Var, F)) {
+      Footprint += DL.getTypeAllocSize(Var.getValueType()).getFixedValue();
+    }
+  }
+
+  for (const auto &Link : RT.ShadowLocalMemLinks) {
+    if (!Link.SpillOffset && is_used_in(*Link.OriginalVar, F)) {
+      Footprint += DL.getTypeAllocSize(Link.ShadowTy).getFixedValue();
+    }
+  }
+
+  return Footprint;
+}
+
+// Keep shadows in local memory while every kernel stays within
+// -scsan-local-mem-budget, spilling the largest ones of a kernel over it to
+// global memory. Spilled shadows share one slice layout across the module.
+static void place_shadows(Module &M, SanitizerRuntime &RT) {
+  const auto &DL = M.getDataLayout();
+
+  for (auto &F : M) {
+    if (F.isDeclaration() || F.getCallingConv() != CallingConv::SPIR_KERNEL) {
+      continue;
+    }
+
+    auto Footprint = get_local_footprint(F, RT);
+    SmallVector<ShadowLocalMemLink *, 4> Local;
+
+    for (auto &Link : RT.ShadowLocalMemLinks) {
+      if (!Link.SpillOffset && is_used_in(*Link.OriginalVar, F)) {
+        Local.push_back(&Link);
+      }
+    }
+
+    llvm::sort(Local, [&](const auto *A, const auto *B) {
+      return DL.getTypeAllocSize(A->ShadowTy).getFixedValue() >
+             DL.getTypeAllocSize(B->ShadowTy).getFixedValue();
+    });
+
+    for (auto *Link : Local) {
+      if (!ClLocalMemBudget || Footprint <= ClLocalMemBudget) {
+        break;
+      }
+
+      const auto Bytes = DL.getTypeAllocSize(Link->ShadowTy).getFixedValue();
+
+      LLVM_DEBUG(dbgs() << "Spilling the shadow of " << *Link->OriginalVar
+                        << " (" << Bytes << " bytes) of " << F.getName()
+                        << " to global memory\n");
+
+      Link->SpillOffset = RT.SpillSliceBytes;
+      RT.SpillSliceBytes += alignTo(Bytes, 16);
+      Footprint -= Bytes;
+
+      NumSpilledShadowBytes += Bytes;
+    }
+
+    RT.LocalFootprints[&F] = Footprint;
+  }
+
+  for (auto &Link : RT.ShadowLocalMemLinks) {
+    if (Link.SpillOffset) {
+      continue;
+    }
+
+    auto VarName = Link.OriginalVar->getName();
+
+    // Whole 16-byte chunks for the unrolled reset
+    Link.ShadowVar = create_local_var(
+        M, Link.ShadowTy, VarName.empty() ? "" : VarName.str() + ".shadow",
+        Align(16));
+
+    NumShadowBytes += DL.getTypeAllocSize(Link.ShadowTy).getFixedValue();
+  }
+}
+
+static SanitizerRuntime get_sanitizer_runtime(Module &M) {
+  auto &Ctx = M.getContext();
+  auto voidTy = Type::getVoidTy(Ctx);
+  auto i8Ty = IntegerType::getInt8Ty(Ctx);
+  auto i16Ty = IntegerType::getInt16Ty(Ctx);
+  auto i32Ty = IntegerType::getInt32Ty(Ctx);
+  auto i64Ty = IntegerType::getInt64Ty(Ctx);
+  auto locali8PtrTy = PointerType::get(
+      i8Ty, LocalAddressSpace); // addrspace(3) pointer to unsigned char
+  auto locali16PtrTy = PointerType::get(
+      i16Ty, LocalAddressSpace); // addrspace(3) pointer to unsigned short
+  auto locali32PtrTy = PointerType::get(
+      i32Ty, LocalAddressSpace); // addrspace(3) pointer to unsigned int
+
+  SanitizerRuntime RT;
+
+  // Report functions, called with the check site id first
+  RT.ReportIndexOutOfBounds =
+      insert_fn(M, "libscsan_report_index_out_of_bounds", voidTy, {i32Ty});
+  RT.ReportLocalMemoryConflict = insert_fn(
+      M, "libscsan_report_local_memory_conflict", voidTy, {i32Ty, i64Ty});
+  RT.Poison = insert_fn(M, "libscsan_poison", voidTy, {});
+  RT.IsPoisoned = insert_fn(M, "libscsan_is_poisoned", i32Ty, {});
+  RT.IsPoisonedWorkGroup =
+      insert_fn(M, "libscsan_is_poisoned_work_group", i32Ty, {});
+
+  // Shadow functions
+  RT.ShadowEnter =
+      insert_fn(M, "libscsan_shadow_enter", voidTy, {locali8PtrTy});
+  RT.ShadowBarrier = insert_fn(M, "libscsan_shadow_barrier", i32Ty,
+                               {locali8PtrTy, i32Ty});
+  RT.ShadowReset = insert_fn(M, "libscsan_shadow_reset", voidTy,
+                             {locali32PtrTy, i64Ty, i32Ty});
+  RT.ShadowSync = insert_fn(M, "libscsan_shadow_sync", voidTy, {i32Ty});
+  RT.ShadowClaim16 = insert_fn(M, "libscsan_shadow_claim_u16", i16Ty,
+                               {locali16PtrTy, i16Ty, i32Ty});
+  RT.ShadowClaim32 = insert_fn(M, "libscsan_shadow_claim_u32", i32Ty,
+                               {locali32PtrTy, i32Ty, i32Ty});
+  RT.ShadowStamp16 = insert_fn(M, "libscsan_shadow_stamp_u16", i16Ty,
+                               {locali16PtrTy, i16Ty, i32Ty});
+  RT.ShadowStamp32 = insert_fn(M, "libscsan_shadow_stamp_u32", i32Ty,
+                               {locali32PtrTy, i32Ty, i32Ty});
+
+  // Shadow functions for the shadows spilled to global memory
+  auto globali8PtrTy = PointerType::get(i8Ty, GlobalAddressSpace);
+  auto globali16PtrTy = PointerType::get(i16Ty, GlobalAddressSpace);
+  auto globali32PtrTy = PointerType::get(i32Ty, GlobalAddressSpace);
+
+  RT.ShadowSpillSlice =
+      insert_fn(M, "libscsan_shadow_spill_slice", globali8PtrTy, {i64Ty});
+  RT.ShadowResetGlobal = insert_fn(M, "libscsan_shadow_reset_global", voidTy,
+                                   {globali32PtrTy, i64Ty, i32Ty});
+  RT.ShadowClaimGlobal16 =
+      insert_fn(M, "libscsan_shadow_claim_global_u16", i16Ty,
+                {globali16PtrTy, i16Ty, i32Ty});
+  RT.ShadowClaimGlobal32 =
+      insert_fn(M, "libscsan_shadow_claim_global_u32", i32Ty,
+                {globali32PtrTy, i32Ty, i32Ty});
+  RT.ShadowStampGlobal16 =
+      insert_fn(M, "libscsan_shadow_stamp_global_u16", i16Ty,
+                {globali16PtrTy, i16Ty, i32Ty});
+  RT.ShadowStampGlobal32 =
+      insert_fn(M, "libscsan_shadow_stamp_global_u32", i32Ty,
+                {globali32PtrTy, i32Ty, i32Ty});
+
+  // Global memory functions
+  RT.GlobalEnter =
+      insert_fn(M, "libscsan_global_enter", voidTy, {locali8PtrTy});
+  RT.GlobalBarrier =
+      insert_fn(M, "libscsan_global_barrier", voidTy, {locali8PtrTy});
+  RT.GlobalWrite =
+      insert_fn(M, "libscsan_global_write", voidTy,
+                {globali8PtrTy, i32Ty, i32Ty, i32Ty, locali8PtrTy});
+
+  // Barrier functions
+  RT.BarrierEnter =
+      insert_fn(M, "libscsan_barrier_enter", voidTy, {locali32PtrTy, i32Ty});
+  RT.BarrierArrive =
+      insert_fn(M, "libscsan_barrier_arrive", i32Ty, {locali32PtrTy});
+  RT.BarrierCheck = insert_fn(M, "libscsan_barrier_check", voidTy,
+                              {locali32PtrTy, i32Ty, i32Ty});
+
+  // Sampling
+  RT.SampleWorkGroup =
+      insert_fn(M, "libscsan_sample_work_group", i32Ty, {});
+
+  RT.FeatureEnabled =
+      insert_fn(M, "libscsan_feature_enabled", i32Ty, {i32Ty});
+
+  const auto MaxWorkGroupSize = get_max_work_group_size(M);
+
+  if (ClOnError == ErrorAction::Return &&
+      any_of(M, [](const Function &F) {
+        return !F.isDeclaration() &&
+               F.getCallingConv() != CallingConv::SPIR_KERNEL;
+      })) {
+    RT.Stopped = create_local_var(M, ArrayType::get(i8Ty, MaxWorkGroupSize),
+                                  "libscsan.stopped", Align(4));
+  }
+
+  if (ClGlobalRaces) {
+    RT.GlobalPhases =
+        create_local_var(M, ArrayType::get(i8Ty, MaxWorkGroupSize),
+                         "libscsan.global.phases", Align(4));
+  }
+
+  // LocalMemoryConflict: Allocate shadow local memory
+
+  RT.ShadowCellTy = get_shadow_cell_type(Ctx, MaxWorkGroupSize);
+  RT.ShadowLocalMemLinks = find_shadow_local_mem_links(M, RT.ShadowCellTy);
+
+  if (RT.ShadowLocalMemLinks.empty()) {
+    return RT;
+  }
+
+  LLVM_DEBUG(dbgs() << "SPIRVComputeSanitizerPass: "
+                    << RT.ShadowCellTy->getBitWidth()
+                    << "-bit shadow cells for work-groups of up to "
+                    << MaxWorkGroupSize << " work-items\n");
+
+  RT.OwnerBits = get_shadow_owner_bits(MaxWorkGroupSize);
+  RT.EpochBits = std::min(RT.ShadowCellTy->getBitWidth() - RT.OwnerBits - 1,
+                          MaxEpochBits);
+  RT.ShadowEpochs =
+      create_local_var(M, ArrayType::get(i8Ty, MaxWorkGroupSize),
+                       "libscsan.shadow.epochs", Align(4));
+
+  NumShadowBytes += MaxWorkGroupSize;
+
+  place_shadows(M, RT);
+
+  return RT;
+}
+
+[[maybe_unused]] static void
+print_shadow_links(const std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks) {
+  if (ShadowLocalMemLinks.empty()) {
+    dbgs() << "No shadow local memory links found.\n";
+
+    return;
+  }
+
+  dbgs() << "Shadow local memory links found:\n";
+
+  for (const auto &Link : ShadowLocalMemLinks) {
+    if (Link.ShadowVar) {
+      dbgs() << "Shadow variable: " << *Link.ShadowVar;
+    } else {
+      dbgs() << "Shadow spilled at offset " << *Link.SpillOffset;
+    }
+
+    dbgs() << ", Original variable: " << *Link.OriginalVar << "\n";
+  }
+}
+
+[[maybe_unused]] static void
+print_array_links(const std::vector<ArraySizeLink> &ArraySizeLinks) {
+  if (ArraySizeLinks.empty()) {
+    dbgs() << "No array links found.\n";
+
+    return;
+  }
+
+  dbgs() << "Array links found:\n";
+
+  for (const auto &[ArrayArg, SizeArg] : ArraySizeLinks) {
+    if (ArrayArg->getType()->isPointerTy()) {
+      dbgs() << "Array argument: " << *ArrayArg
+             << ", Size argument: " << *SizeArg << "\n";
+    } else {
+      dbgs() << "Invalid link found: " << *ArrayArg << "\n";
+    }
+  }
+}
+
+// Clear the shadows in straight-line code. With the work-group size known,
+// work-item i stores the 16-byte chunks i, i + size, ... of each shadow. The
+// last round clamps its index, so spare work-items store zero to the last
+// chunk again instead of branching.
+static void emit_unrolled_shadow_reset(
+    IRBuilder<> &Builder, ArrayRef<const ShadowLocalMemLink *> Shadows,
+    Value *Fresh, uint64_t WorkGroupSize) {
+  auto &F = *Builder.GetInsertBlock()->getParent();
+  const auto &DL = F.getParent()->getDataLayout();
+  BasicBlock *Tail = nullptr;
+
+  // At kernel entry the shadows are always cleared
+  if (!isa<ConstantInt>(Fresh)) {
+    auto *Head = Builder.GetInsertBlock();
+
+    Tail = split_block_at(F, *Head, Builder.GetInsertPoint());
+
+    auto *Clear = BasicBlock::Create(F.getContext(), "", &F, Tail);
+
+    Builder.SetInsertPoint(Head);
+    Builder.CreateCondBr(Builder.CreateIsNotNull(Fresh), Clear, Tail);
+    Builder.SetInsertPoint(Clear);
+  }
+
+  auto *Int32Ty = Builder.getInt32Ty();
+  auto *Int64Ty = Builder.getInt64Ty();
+  auto *ChunkTy = FixedVectorType::get(Int32Ty, 4);
+  auto *LocalId = create_local_linear_id(Builder, F);
+
+  // Index + Base, or Last once that is past it
+  const auto clamped_index = [&](uint64_t Base, uint64_t Last) -> Value * {
+    auto *Index = Builder.CreateAdd(LocalId, ConstantInt::get(Int64Ty, Base));
+
+    if (Base + WorkGroupSize <= Last + 1) {
+      return Index;
+    }
+
+    auto *LastIndex = ConstantInt::get(Int64Ty, Last);
+
+    return Builder.CreateSelect(Builder.CreateICmpULT(Index, LastIndex), Index,
+                                LastIndex);
+  };
+
+  for (const auto *Link : Shadows) {
+    auto *ShadowVar = Link->ShadowVar;
+    const auto Words =
+        DL.getTypeAllocSize(ShadowVar->getValueType()).getFixedValue() / 4;
+    const auto Chunks = Words / 4;
+
+    for (uint64_t Base = 0; Base < Chunks; Base += WorkGroupSize) {
+      Builder.CreateAlignedStore(
+          Constant::getNullValue(ChunkTy),
+          Builder.CreateInBoundsGEP(ChunkTy, ShadowVar,
+                                    clamped_index(Base, Chunks - 1)),
+          Align(16));
+    }
+
+    // Words past the last whole chunk
+    for (uint64_t Base = Chunks * 4; Base < Words; Base += WorkGroupSize) {
+      Builder.CreateAlignedStore(
+          ConstantInt::get(Int32Ty, 0),
+          Builder.CreateInBoundsGEP(Int32Ty, ShadowVar,
+                                    clamped_index(Base, Words - 1)),
+          Align(4));
+    }
+  }
+
+  if (Tail) {
+    Builder.CreateBr(Tail);
+    Builder.SetInsertPoint(Tail, Tail->begin());
+  }
+}
+
+// Clear Shadows when Fresh is set, then wait for the whole work-group.
+// Returns the bytes of local memory the shadows take.
+static uint64_t reset_shadows(IRBuilder<> &Builder,
+                              ArrayRef<const ShadowLocalMemLink *> Shadows,
+                              Value *Fresh, SanitizerRuntime &RT) {
+  const auto &F = *Builder.GetInsertBlock()->getParent();
+  const auto &DL = F.getParent()->getDataLayout();
+  const auto WorkGroupSize = get_reqd_work_group_size(F);
+  SmallVector<const ShadowLocalMemLink *, 4> LocalShadows;
+  SmallVector<const ShadowLocalMemLink *, 4> SpilledShadows;
+  uint64_t ShadowBytes = 0;
+  uint64_t Rounds = 0;
+
+  for (const auto *Link : Shadows) {
+    const auto Bytes = DL.getTypeAllocSize(Link->ShadowTy).getFixedValue();
+
+    if (!Link->ShadowVar) {
+      SpilledShadows.push_back(Link);
+      continue;
+    }
+
+    LocalShadows.push_back(Link);
+    ShadowBytes += Bytes;
+
+    if (WorkGroupSize) {
+      Rounds += divideCeil(Bytes / 16, *WorkGroupSize) +
+                divideCeil(Bytes % 16 / 4, *WorkGroupSize);
+    }
+  }
+
+  if (LocalShadows.empty()) {
+    // Nothing to clear in local memory
+  } else if (WorkGroupSize && Rounds <= MaxUnrolledResetStores) {
+    emit_unrolled_shadow_reset(Builder, LocalShadows, Fresh, *WorkGroupSize);
+  } else {
+    for (const auto *Link : LocalShadows) {
+      const auto Bytes = DL.getTypeAllocSize(Link->ShadowTy).getFixedValue();
+
+      add_sanitizer_call(
+          Builder, RT.ShadowReset,
+          {Builder.CreatePointerCast(
+               Link->ShadowVar,
+               RT.ShadowReset.getFunctionType()->getParamType(0)),
+           ConstantInt::get(Type::getInt64Ty(Builder.getContext()), Bytes / 4),
+           Fresh});
+    }
+  }
+
+  for (const auto *Link : SpilledShadows) {
+    const auto Bytes = DL.getTypeAllocSize(Link->ShadowTy).getFixedValue();
+
+    add_sanitizer_call(
+        Builder, RT.ShadowResetGlobal,
+        {Builder.CreatePointerCast(
+             get_shadow_base(Builder, *Link, RT),
+             RT.ShadowResetGlobal.getFunctionType()->getParamType(0)),
+         ConstantInt::get(Type::getInt64Ty(Builder.getContext()), Bytes / 4),
+         Fresh});
+  }
+
+  add_sanitizer_call(Builder, RT.ShadowSync, {Fresh});
+
+  return ShadowBytes;
+}
+
+static bool is_barrier_call(const Instruction &Inst) {
+  const auto *Call = dyn_cast<CallInst>(&Inst);
+  const auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+
+  return Callee && is_contained(barrier_names, Callee->getName());
+}
+
+// Advance the barrier epoch after every barrier, so stores from earlier
+// phases no longer conflict. When the epoch wraps, kernels clear their
+// shadows; helper functions cannot see them and keep the stale cells.
+static void inject_barrier_epochs(Function &F,
+                                  ArrayRef<const ShadowLocalMemLink *> Shadows,
+                                  SanitizerRuntime &RT) {
+  SmallVector<Instruction *, 8> Barriers;
+
+  for (auto &Inst : instructions(F)) {
+    if (is_barrier_call(Inst)) {
+      Barriers.push_back(&Inst);
+    }
+  }
+
+  for (auto *Barrier : Barriers) {
+    IRBuilder<> Builder(Barrier->getNextNode());
+
+    auto *Advanced = begin_feature_guard(Builder, FeatureLocalRaces, RT);
+    auto *Fresh = add_sanitizer_call(
+        Builder, RT.ShadowBarrier,
+        {Builder.CreatePointerCast(
+             RT.ShadowEpochs,
+             RT.ShadowBarrier.getFunctionType()->getParamType(0)),
+         ConstantInt::get(Type::getInt32Ty(F.getContext()), RT.EpochBits)});
+
+    if (!Shadows.empty()) {
+      reset_shadows(Builder, Shadows, Fresh, RT);
+    }
+
+    end_feature_guard(Builder, Advanced);
+  }
+}
+
+// Whether every work-item of a work-group computes the same V, as long as
+// the branches leading to V are uniform too. Kernel arguments are, and the
+// arguments of a helper when every call in the module passes a uniform
+// value. Loop-carried values and recursive calls are assumed uniform until
+// an incoming value proves otherwise.
+static bool is_uniform_value(const Value *V,
+                             SmallPtrSetImpl<const Value *> &Visited,
+                             unsigned Depth = 0) {
+  if (isa<Constant>(V)) {
+    return true;
+  }
+
+  if (!Visited.insert(V).second) {
+    return true;
+  }
+
+  if (Depth > MaxUniformDepth) {
+    return false;
+  }
+
+  if (const auto *Arg = dyn_cast<Argument>(V)) {
+    const auto *F = Arg->getParent();
+
+    if (F->getCallingConv() == CallingConv::SPIR_KERNEL) {
+      return true;
+    }
+
+    return !F->use_empty() && all_of(F->uses(), [&](const Use &U) {
+      const auto *Call = dyn_cast<CallInst>(U.getUser());
+
+      return Call && Call->isCallee(&U) &&
+             is_uniform_value(Call->getArgOperand(Arg->getArgNo()), Visited,
+                              Depth + 1);
+    });
+  }
+
+  if (const auto *Call = dyn_cast<CallInst>(V)) {
+    return is_uniform_builtin_call(*Call);
+  }
+
+  if (const auto *Load = dyn_cast<LoadInst>(V)) {
+    // Locals the front end keeps in allocas: uniform when every value
+    // stored is, since the stores sit behind uniform branches as well
+    const auto *Slot = dyn_cast<AllocaInst>(Load->getPointerOperand());
+
+    if (!Slot) {
+      return false;
+    }
+
+    if (!Visited.insert(Slot).second) {
+      return true;
+    }
+
+    for (const auto *U : Slot->users()) {
+      if (const auto *Store = dyn_cast<StoreInst>(U)) {
+        if (Store->getPointerOperand() != Slot ||
+            !is_uniform_value(Store->getValueOperand(), Visited, Depth + 1)) {
+          return false;
+        }
+      } else if (const auto *Marker = dyn_cast<IntrinsicInst>(U);
+                 !isa<LoadInst>(U) &&
+                 !(Marker && Marker->isLifetimeStartOrEnd())) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  if (!isa<BinaryOperator, CastInst, CmpInst, SelectInst, PHINode,
+           GetElementPtrInst, FreezeInst>(V)) {
+    return false;
+  }
+
+  return std::all_of(cast<User>(V)->op_begin(), cast<User>(V)->op_end(),
+                     [&](const Use &Op) {
+                       return is_uniform_value(Op, Visited, Depth + 1);
+                     });
+}
+
+// Whether the whole work-group reaches Inst the same number of times: every
+// branch from which it can be reached is uniform, and in a helper so is
+// every call of it in the module. Recursive helpers and helpers whose
+// address is taken are not.
+static bool is_uniform_point(const Instruction &Inst,
+                             SmallPtrSetImpl<const Value *> &Visited,
+                             SmallPtrSetImpl<const Function *> &Callers) {
+  SmallPtrSet<const BasicBlock *, 16> Seen;
+  SmallVector<const BasicBlock *, 16> Worklist(predecessors(Inst.getParent()));
+
+  while (!Worklist.empty()) {
+    const auto *Block = Worklist.pop_back_val();
+
+    if (!Seen.insert(Block).second) {
+      continue;
+    }
+
+    const auto *Terminator = Block->getTerminator();
+    const Value *Condition = nullptr;
+
+    if (const auto *Branch = dyn_cast<BranchInst>(Terminator)) {
+      Condition = Branch->isConditional() ? Branch->getCondition() : nullptr;
+    } else if (const auto *Switch = dyn_cast<SwitchInst>(Terminator)) {
+      Condition = Switch->getCondition();
+    } else {
+      return false;
+    }
+
+    if (Condition && !is_uniform_value(Condition, Visited)) {
+      return false;
+    }
+
+    Worklist.append(pred_begin(Block), pred_end(Block));
+  }
+
+  const auto *F = Inst.getFunction();
+
+  if (F->getCallingConv() == CallingConv::SPIR_KERNEL) {
+    return true;
+  }
+
+  if (!Callers.insert(F).second) {
+    return false;
+  }
+
+  const bool Uniform =
+      !F->use_empty() && all_of(F->uses(), [&](const Use &U) {
+        const auto *Call = dyn_cast<CallInst>(U.getUser());
+
+        return Call && Call->isCallee(&U) &&
+               is_uniform_point(*Call, Visited, Callers);
+      });
+
+  Callers.erase(F);
+
+  return Uniform;
+}
+
+static bool is_uniform_barrier(const CallInst &Barrier) {
+  SmallPtrSet<const Value *, 16> Visited;
+  SmallPtrSet<const Function *, 4> Callers;
+
+  return is_uniform_point(Barrier, Visited, Callers);
+}
+
+// Whether Barrier orders local memory for the whole work-group. Flags only
+// known at run time do not count.
+static bool is_local_fence_barrier(const CallInst &Barrier) {
+  const auto Name = Barrier.getCalledFunction()->getName();
+
+  if (Name == "_Z22__spirv_ControlBarrieriii") {
+    const auto *Scope = dyn_cast<ConstantInt>(Barrier.getArgOperand(1));
+    const auto *Flags = dyn_cast<ConstantInt>(Barrier.getArgOperand(2));
+
+    return Scope && Flags && Scope->getZExtValue() <= WorkgroupScope &&
+           (Flags->getZExtValue() & WorkgroupMemory);
+  }
+
+  // The memory scope of work_group_barrier(flags, scope) may be narrower
+  if (Name == "_Z18work_group_barrierj12memory_scope") {
+    return false;
+  }
+
+  const auto *Flags = dyn_cast<ConstantInt>(Barrier.getArgOperand(0));
+
+  return Flags && (Flags->getZExtValue() & LocalMemFence);
+}
+
+// The first barrier of Kernel that the whole work-group passes before every
+// checked barrier and every call that may reach one
+static const CallInst *find_entry_barrier(Function &Kernel,
+                                          FunctionAnalysisManager &FAM,
+                                          const SanitizerRuntime &RT) {
+  const auto Checked = RT.CheckedBarriers.lookup(&Kernel);
+  SmallVector<const CallInst *, 8> Followers;
+  SmallVector<const CallInst *, 4> Candidates;
+
+  for (auto &Inst : instructions(Kernel)) {
+    const auto *Call = dyn_cast<CallInst>(&Inst);
+
+    if (!Call) {
+      continue;
+    }
+
+    const auto *Callee = Call->getCalledFunction();
+
+    if (is_contained(Checked, Call) || !Callee ||
+        RT.ReachCheckedBarriers.contains(Callee)) {
+      Followers.push_back(Call);
+    } else if (is_barrier_call(*Call) && is_local_fence_barrier(*Call)) {
+      Candidates.push_back(Call);
+    }
+  }
+
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(Kernel);
+
+  for (const auto *Candidate : Candidates) {
+    if (all_of(Followers, [&](const CallInst *Follower) {
+          return DT.dominates(Candidate, Follower);
+        })) {
+      return Candidate;
+    }
+  }
+
+  return nullptr;
+}
+
+// Pick the barriers that get an arrival check. This has to run before any
+// other instrumentation, whose checks branch on per-work-item conditions.
+static void plan_barrier_checks(Module &M, ArrayRef<Function *> Functions,
+                                FunctionAnalysisManager &FAM,
+                                SanitizerRuntime &RT) {
+  for (auto *F : Functions) {
+    auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(*F);
+
+    for (auto &Inst : instructions(*F)) {
+      if (!is_barrier_call(Inst)) {
+        continue;
+      }
+
+      if (is_uniform_barrier(cast<CallInst>(Inst))) {
+        ORE.emit([&] {
+          return OptimizationRemark(DEBUG_TYPE, "BarrierCheckElided", &Inst)
+                 << "barrier reached by the whole work-group, arrival check "
+                    "elided";
+        });
+
+        ++NumUniformBarriers;
+
+        continue;
+      }
+
+      RT.CheckedBarriers[F].push_back(cast<CallInst>(&Inst));
+    }
+  }
+
+  if (RT.CheckedBarriers.empty()) {
+    return;
+  }
+
+  RT.BarrierArrivals =
+      create_local_var(M, Type::getInt32Ty(M.getContext()),
+                       "libscsan.barrier.arrivals", Align(4));
+
+  // Walk up the callers, counting any use of a function inside another as
+  // a possible call
+  SmallVector<const Function *, 16> Worklist;
+
+  for (const auto &Checked : RT.CheckedBarriers) {
+    RT.ReachCheckedBarriers.insert(Checked.first);
+    Worklist.push_back(Checked.first);
+  }
+
+  while (!Worklist.empty()) {
+    for (const auto *U : Worklist.pop_back_val()->users()) {
+      const auto *Inst = dyn_cast<Instruction>(U);
+
+      if (Inst && RT.ReachCheckedBarriers.insert(Inst->getFunction()).second) {
+        Worklist.push_back(Inst->getFunction());
+      }
+    }
+  }
+
+  for (auto *F : Functions) {
+    if (F->getCallingConv() != CallingConv::SPIR_KERNEL ||
+        !RT.ReachCheckedBarriers.contains(F)) {
       continue;
     }
 
-    if (Var.isExternallyInitialized()) {
-      errs() << "Skipping external global variable: " << Var << "\n";
+    if (const auto *Barrier = find_entry_barrier(*F, FAM, RT)) {
+      RT.EntryBarriers[F] = Barrier;
+    }
+  }
+}
+
+// Take a ticket before each checked barrier and compare it with the arrivals
+// after it. Kernels that may reach one reset the count at entry, with a
+// barrier of their own unless one of the kernel's comes first.
+static void inject_barrier_checks(Function &F, SanitizerRuntime &RT) {
+  if (!RT.BarrierArrivals) {
+    return;
+  }
+
+  const auto Barriers = RT.CheckedBarriers.find(&F);
+  auto *Arrivals = ConstantExpr::getPointerCast(
+      RT.BarrierArrivals, RT.BarrierArrive.getFunctionType()->getParamType(0));
+
+  if (Barriers != RT.CheckedBarriers.end()) {
+    for (auto *Barrier : Barriers->second) {
+      IRBuilder<> Builder(Barrier);
+
+      auto *Arrived = begin_feature_guard(Builder, FeatureBarriers, RT);
+      auto *Ticket = end_feature_guard(
+          Builder, Arrived,
+          add_sanitizer_call(Builder, RT.BarrierArrive, {Arrivals}));
+
+      Builder.SetInsertPoint(Barrier->getNextNode());
+
+      auto *Checked = begin_feature_guard(Builder, FeatureBarriers, RT);
+
+      add_sanitizer_call(Builder, RT.BarrierCheck,
+                         {Arrivals, Ticket,
+                          create_site_id(RT, *Barrier, "barrier")});
+      end_feature_guard(Builder, Checked);
+
+      ++NumBarrierChecks;
+    }
+  }
+
+  if (F.getCallingConv() == CallingConv::SPIR_KERNEL &&
+      RT.ReachCheckedBarriers.contains(&F)) {
+    auto &Entry = F.getEntryBlock();
+    IRBuilder<> Builder(&Entry, Entry.getFirstNonPHIOrDbgOrAlloca());
+
+    auto *Entered = begin_feature_guard(Builder, FeatureBarriers, RT);
+    auto *Sync = Builder.getInt32(!RT.EntryBarriers.count(&F));
+
+    add_sanitizer_call(Builder, RT.BarrierEnter, {Arrivals, Sync});
+    end_feature_guard(Builder, Entered);
+  }
+}
+
+// Whether Barrier orders global memory. Flags only known at run time count
+// as fencing it.
+static bool is_global_fence_barrier(const CallInst &Barrier) {
+  const bool IsSPIRV =
+      Barrier.getCalledFunction()->getName() == "_Z22__spirv_ControlBarrieriii";
+  const auto *Flags =
+      dyn_cast<ConstantInt>(Barrier.getArgOperand(IsSPIRV ? 2 : 0));
+
+  return !Flags || (Flags->getZExtValue() &
+                    (IsSPIRV ? CrossWorkgroupMemory : GlobalMemFence));
+}
+
+// Record every plain store to global memory in the runtime's shadow table.
+// Atomics never race, and the table has no room for reads. Barriers fencing
+// global memory start a new phase, which orders the writes of a work-group.
+static void inject_global_write_checks(Function &F, SanitizerRuntime &RT) {
+  const auto &DL = F.getParent()->getDataLayout();
+  auto *Int32Ty = Type::getInt32Ty(F.getContext());
+  auto *Phases = ConstantExpr::getPointerCast(
+      RT.GlobalPhases, RT.GlobalWrite.getFunctionType()->getParamType(4));
+  SmallVector<StoreInst *, 16> Stores;
+  SmallVector<CallInst *, 4> Barriers;
+
+  for (auto &Inst : instructions(F)) {
+    if (auto *Store = dyn_cast<StoreInst>(&Inst);
+        Store && !Store->isAtomic() &&
+        Store->getPointerAddressSpace() == GlobalAddressSpace) {
+      Stores.push_back(Store);
+    } else if (is_barrier_call(Inst) &&
+               is_global_fence_barrier(cast<CallInst>(Inst))) {
+      Barriers.push_back(cast<CallInst>(&Inst));
+    }
+  }
+
+  if (F.getCallingConv() == CallingConv::SPIR_KERNEL) {
+    auto &Entry = F.getEntryBlock();
+    IRBuilder<> Builder(&Entry, Entry.getFirstNonPHIOrDbgOrAlloca());
+
+    auto *Entered = begin_feature_guard(Builder, FeatureGlobalRaces, RT);
+
+    add_sanitizer_call(Builder, RT.GlobalEnter, {Phases});
+    end_feature_guard(Builder, Entered);
+  }
+
+  for (auto *Barrier : Barriers) {
+    IRBuilder<> Builder(Barrier->getNextNode());
+
+    auto *Advanced = begin_feature_guard(Builder, FeatureGlobalRaces, RT);
+
+    add_sanitizer_call(Builder, RT.GlobalBarrier, {Phases});
+    end_feature_guard(Builder, Advanced);
+  }
+
+  for (auto *Store : Stores) {
+    IRBuilder<> Builder(Store);
+
+    const auto Size = DL.getTypeStoreSize(Store->getValueOperand()->getType())
+                          .getFixedValue();
+    // Adjacent char or short stores of different work-items do not share a
+    // slot
+    const auto Granule =
+        MinAlign(Size, std::max(1u, ClGlobalGranularity.getValue()));
+    auto *Recorded = begin_feature_guard(Builder, FeatureGlobalRaces, RT);
+
+    add_sanitizer_call(
+        Builder, RT.GlobalWrite,
+        {Builder.CreatePointerCast(
+             Store->getPointerOperand(),
+             RT.GlobalWrite.getFunctionType()->getParamType(0)),
+         ConstantInt::get(Int32Ty, Size),
+         ConstantInt::get(Int32Ty, Log2_64(Granule)),
+         create_site_id(RT, *Store, "global write"), Phases});
+    end_feature_guard(Builder, Recorded);
+
+    ++NumGlobalWriteChecks;
+  }
+}
+
+// Functions with no linked array, local array or barrier have nothing to
+// check, unless a module-wide check applies to them
+static bool needs_instrumentation(const Function &F,
+                                  ArrayRef<ArraySizeLink> ArraySizeLinks,
+                                  const SanitizerRuntime &RT) {
+  if (F.getCallingConv() == CallingConv::SPIR_KERNEL ||
+      !ArraySizeLinks.empty() || ClGlobalRaces ||
+      ClOnError == ErrorAction::Abort || RT.CheckedBarriers.count(&F)) {
+    return true;
+  }
+
+  if (any_of(RT.ShadowLocalMemLinks, [&](const auto &Link) {
+        return is_used_in(*Link.OriginalVar, F);
+      })) {
+    return true;
+  }
 
+  // Barriers advance the shadow epochs
+  return !RT.ShadowLocalMemLinks.empty() &&
+         any_of(instructions(F),
+                [](const Instruction &Inst) { return is_barrier_call(Inst); });
+}
+
+// Whether a call from F may wait at a barrier, directly or in a callee
+static bool may_reach_barrier(const Function &F,
+                              SmallPtrSetImpl<const Function *> &Visited) {
+  if (!Visited.insert(&F).second) {
+    return false;
+  }
+
+  for (const auto &Inst : instructions(F)) {
+    const auto *Call = dyn_cast<CallInst>(&Inst);
+    const auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+
+    if (is_barrier_call(Inst) ||
+        (Callee && !Callee->isDeclaration() &&
+         may_reach_barrier(*Callee, Visited))) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool may_reach_barrier(const BasicBlock &Block) {
+  for (const auto &Inst : Block) {
+    const auto *Call = dyn_cast<CallInst>(&Inst);
+    const auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+    SmallPtrSet<const Function *, 8> Visited;
+
+    if (is_barrier_call(Inst) || (Callee && !Callee->isDeclaration() &&
+                                  may_reach_barrier(*Callee, Visited))) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// -scsan-on-error=abort: return once a failed check poisoned the dispatch.
+// Kernels poll at entry with one answer per work-group. Other functions and
+// loop back-edges poll per work-item, only where no barrier can follow
+// inside, so the work-items that keep going are never stuck on one.
+static void inject_poison_checks(Function &F, SanitizerRuntime &RT) {
+  const auto IsKernel = F.getCallingConv() == CallingConv::SPIR_KERNEL;
+  SmallVector<std::pair<Instruction *, FunctionCallee>, 8> Polls;
+  SmallPtrSet<const Function *, 8> Visited;
+
+  if (IsKernel || !may_reach_barrier(F, Visited)) {
+    Polls.push_back({&*F.getEntryBlock().getFirstNonPHIOrDbgOrAlloca(),
+                     IsKernel ? RT.IsPoisonedWorkGroup : RT.IsPoisoned});
+  }
+
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+
+  for (auto *L : LI.getLoopsInPreorder()) {
+    if (any_of(L->blocks(),
+               [](const BasicBlock *Block) {
+                 return may_reach_barrier(*Block);
+               })) {
       continue;
     }
 
-    // Var is array?
-    if (!Var.getValueType()->isArrayTy()) {
-      errs() << "Skipping global variable that is not an array: " << Var
-             << "\n";
+    SmallVector<BasicBlock *, 4> Latches;
+    L->getLoopLatches(Latches);
+
+    for (auto *Latch : Latches) {
+      Polls.push_back({Latch->getTerminator(), RT.IsPoisoned});
+    }
+  }
+
+  for (auto &[At, Poll] : Polls) {
+    auto &Block = *At->getParent();
+    auto *Tail = split_block_at(F, Block, At->getIterator());
+    auto *Exit = BasicBlock::Create(F.getContext(), "", &F);
+
+    IRBuilder<> Builder(&Block);
+
+    auto *Poisoned = add_sanitizer_call(Builder, Poll, {});
+
+    Builder.CreateCondBr(Builder.CreateIsNotNull(Poisoned), Exit, Tail);
+
+    IRBuilder<> ExitBuilder(Exit);
+
+    create_early_return(ExitBuilder);
+
+    ++NumPoisonChecks;
+  }
+}
+
+// A helper that returned early after a failed check gives its caller
+// nothing to go on with. Every call to one is followed by a poll of the
+// poison flag (abort) or the work-item's stop flag (return), returning from
+// the caller as well, so the work-item stops in the kernel. Kernels that
+// call one clear their work-items' stop flags at entry.
+static void inject_stop_checks(SanitizerRuntime &RT) {
+  SmallVector<Function *, 8> Worklist(RT.StoppingFunctions.begin(),
+                                      RT.StoppingFunctions.end());
+  SmallPtrSet<Function *, 8> Kernels;
+
+  while (!Worklist.empty()) {
+    auto *Callee = Worklist.pop_back_val();
+    SmallVector<CallInst *, 8> Calls;
+
+    for (auto *U : Callee->users()) {
+      auto *Call = dyn_cast<CallInst>(U);
+
+      if (Call && Call->getCalledFunction() == Callee) {
+        Calls.push_back(Call);
+      }
+    }
+
+    for (auto *Call : Calls) {
+      auto &Caller = *Call->getFunction();
+      auto &Block = *Call->getParent();
+      auto *Tail =
+          split_block_at(Caller, Block, std::next(Call->getIterator()));
+      auto *Exit = BasicBlock::Create(Caller.getContext(), "", &Caller);
+
+      IRBuilder<> Builder(&Block);
+
+      auto *Stopped =
+          ClOnError == ErrorAction::Abort
+              ? static_cast<Value *>(add_sanitizer_call(Builder, RT.IsPoisoned,
+                                                        {}))
+              : Builder.CreateLoad(Builder.getInt8Ty(),
+                                   create_stop_flag_ptr(Builder, RT));
+
+      Builder.CreateCondBr(Builder.CreateIsNotNull(Stopped), Exit, Tail);
+
+      IRBuilder<> ExitBuilder(Exit);
+
+      create_early_return(ExitBuilder);
+
+      ++NumStopChecks;
+
+      if (Caller.getCallingConv() == CallingConv::SPIR_KERNEL) {
+        Kernels.insert(&Caller);
+      } else if (RT.StoppingFunctions.insert(&Caller).second) {
+        Worklist.push_back(&Caller);
+      }
+    }
+  }
 
+  if (ClOnError != ErrorAction::Return) {
+    return;
+  }
+
+  for (auto *Kernel : Kernels) {
+    auto &Entry = Kernel->getEntryBlock();
+    IRBuilder<> Builder(&Entry, Entry.getFirstNonPHIOrDbgOrAlloca());
+
+    Builder.CreateStore(Builder.getInt8(0), create_stop_flag_ptr(Builder, RT));
+  }
+
+  // Helpers whose checks were all proven or elided never set a flag, and
+  // the local memory would be charged to kernels that cannot stop
+  if (RT.Stopped && RT.Stopped->use_empty()) {
+    RT.Stopped->eraseFromParent();
+    RT.Stopped = nullptr;
+  }
+}
+
+// Innermost loops worth an unchecked copy: every array access left to
+// check inside has an index range computable before the loop. Loops with a
+// barrier are left alone, as work-items of one work-group may pick
+// different copies.
+static SmallVector<LoopVersion, 4>
+plan_loop_versions(LoopInfo &LI, ScalarEvolution &SE,
+                   std::vector<ArraySizeLink> &ArraySizeLinks,
+                   const LoopCheckPlan &LoopChecks,
+                   const SmallPtrSetImpl<const Instruction *> &ProvenGEPs,
+                   OptimizationRemarkEmitter &ORE) {
+  SmallVector<LoopVersion, 4> Versions;
+
+  for (auto *L : LI.getLoopsInPreorder()) {
+    auto *Preheader = L->getLoopPreheader();
+
+    if (!L->isInnermost() || !Preheader || !L->getUniqueExitBlock() ||
+        !L->hasDedicatedExits() ||
+        any_of(L->blocks(), [](const BasicBlock *Block) {
+          return may_reach_barrier(*Block);
+        })) {
       continue;
     }
 
-    errs() << "Found local array buffer: " << Var << "\n";
+    SCEVExpander Expander(SE, Preheader->getModule()->getDataLayout(),
+                          "scsan.range");
+    LoopVersion Version{L, {}};
+    const GetElementPtrInst *Unversionable = nullptr;
 
-    // Create a global variable to hold the shadow local memory
-    auto VarName = Var.getName();
-    auto ShadowVarName = VarName.empty() ? "" : VarName.str() + ".shadow";
-    auto ShadowVarTy =
-        ArrayType::get(Type::getInt64Ty(F.getContext()),
-                       Var.getValueType()->getArrayNumElements());
+    for (auto *Block : L->blocks()) {
+      for (auto Inst = Block->begin(), E = Block->end(); Inst != E; ++Inst) {
+        const auto *GetElementPtr = dyn_cast<GetElementPtrInst>(Inst);
 
-    auto MaybeShadowVar =
-        F.getParent()->getOrInsertGlobal(ShadowVarName, ShadowVarTy, [&]() {
-          return new GlobalVariable(
-              *F.getParent(), ShadowVarTy, false, GlobalValue::InternalLinkage,
-              UndefValue::get(ShadowVarTy), ShadowVarName, &Var,
-              GlobalValue::NotThreadLocal, LocalAddressSpace, false);
-        });
+        if (!GetElementPtr || ProvenGEPs.contains(GetElementPtr) ||
+            LoopChecks.HoistedGEPs.contains(GetElementPtr)) {
+          continue;
+        }
 
-    if (auto ShadowVar = dyn_cast<GlobalVariable>(MaybeShadowVar)) {
-      ShadowVar->setAlignment(Align(8));
+        const auto MaybeGEPPair =
+            find_injectable_gep(ArraySizeLinks, Inst, GetElementPtr);
 
-      ret.push_back({ShadowVar, &Var});
-    } else {
-      errs() << "Failed to create shadow variable for: " << Var << "\n";
+        if (!MaybeGEPPair) {
+          continue;
+        }
+
+        const auto *Link =
+            find_array_size_link(ArraySizeLinks, MaybeGEPPair->second);
+
+        if (!Link) {
+          continue;
+        }
+
+        auto *IndexOperand = GetElementPtr->getOperand(1);
+        const SCEV *Runs = nullptr;
+        const auto *MaxIndex =
+            IndexOperand->getType() == Link->SizeArg->getType() &&
+                    SE.isSCEVable(IndexOperand->getType())
+                ? get_access_max_index(SE, L, Block,
+                                       SE.getSCEV(IndexOperand), Runs)
+                : nullptr;
+
+        if (!MaxIndex ||
+            !Expander.isSafeToExpandAt(MaxIndex, Preheader->getTerminator()) ||
+            (Runs &&
+             !Expander.isSafeToExpandAt(Runs, Preheader->getTerminator()))) {
+          Unversionable = GetElementPtr;
+
+          break;
+        }
+
+        Version.Checks.push_back(
+            {GetElementPtr, MaxIndex, Link->SizeArg, Runs});
+      }
+
+      if (Unversionable) {
+        break;
+      }
+    }
+
+    if (Unversionable) {
+      ORE.emit([&] {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "LoopNotVersioned",
+                                        Unversionable)
+               << "loop not versioned: index range of an access not "
+                  "computable";
+      });
+
+      continue;
+    }
+
+    if (!Version.Checks.empty()) {
+      Versions.push_back(std::move(Version));
     }
   }
 
-  return ret;
+  return Versions;
 }
 
-static void
-print_shadow_links(const std::vector<ShadowLocalMemLink> &ShadowLocalMemLinks) {
-  if (ShadowLocalMemLinks.empty()) {
-    errs() << "No shadow local memory links found.\n";
+// Clone each planned loop and pick a copy in its preheader: the clone when
+// the whole range test passes, the original, which keeps its checks,
+// otherwise. The GEPs of the clone are recorded in LoopChecks so that they
+// get no check.
+static void version_loops(Function &F, ArrayRef<LoopVersion> Versions,
+                          LoopInfo &LI, DominatorTree &DT, ScalarEvolution &SE,
+                          Value *BoundsEnabled, LoopCheckPlan &LoopChecks,
+                          OptimizationRemarkEmitter &ORE) {
+  SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "scsan.range");
+
+  for (const auto &Version : Versions) {
+    auto *L = Version.L;
+
+    // Values used after the loop then flow through exit block PHIs, which
+    // are all that has to learn about the clone
+    formLCSSA(*L, DT, &LI, &SE);
+
+    auto *Preheader = L->getLoopPreheader();
+    auto *Exit = L->getUniqueExitBlock();
+
+    IRBuilder<> Builder(Preheader->getTerminator());
+
+    auto *InBounds = guard_bounds_check(
+        Builder, create_loop_range_test(Builder, Expander, Version.Checks),
+        BoundsEnabled);
+    auto *CheckedPreheader =
+        SplitBlock(Preheader, Preheader->getTerminator(), &DT, &LI, nullptr,
+                   L->getHeader()->getName() + ".checked");
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> FastBlocks;
+    auto *FastLoop = cloneLoopWithPreheader(CheckedPreheader, Preheader, L,
+                                            VMap, ".fast", &LI, &DT,
+                                            FastBlocks);
+
+    remapInstructionsInBlocks(FastBlocks, VMap);
+
+    for (auto &Phi : Exit->phis()) {
+      for (unsigned I = 0, E = Phi.getNumIncomingValues(); I != E; ++I) {
+        auto *From = Phi.getIncomingBlock(I);
+
+        if (!L->contains(From)) {
+          continue;
+        }
+
+        auto *Incoming = Phi.getIncomingValue(I);
+
+        if (Value *Mapped = VMap.lookup(Incoming)) {
+          Incoming = Mapped;
+        }
+
+        Phi.addIncoming(Incoming, cast<BasicBlock>(VMap[From]));
+      }
+    }
+
+    auto *Terminator = Preheader->getTerminator();
+
+    Builder.SetInsertPoint(Terminator);
+    Builder.CreateCondBr(InBounds, FastLoop->getLoopPreheader(),
+                         CheckedPreheader);
+    Terminator->eraseFromParent();
+
+    DT.changeImmediateDominator(Exit, Preheader);
+
+    for (auto *Block : FastBlocks) {
+      for (auto &Inst : *Block) {
+        if (isa<GetElementPtrInst>(Inst)) {
+          LoopChecks.VersionedGEPs.insert(&Inst);
+        }
+      }
+    }
+
+    ++NumVersionedLoops;
+
+    ORE.emit([&] {
+      return OptimizationRemark(DEBUG_TYPE, "LoopVersioned",
+                                L->getStartLoc(), L->getHeader())
+             << "loop versioned: "
+             << ore::NV("Checks", unsigned(Version.Checks.size()))
+             << " bounds checks skipped when the range test passes";
+    });
+  }
+}
+
+static void instrument_function(Function &F, FunctionAnalysisManager &FAM,
+                                SanitizerRuntime &RT) {
+  std::vector<ArraySizeLink> ArraySizeLinks = find_array_size_links(F, RT);
+
+  if (!needs_instrumentation(F, ArraySizeLinks, RT)) {
+    LLVM_DEBUG(dbgs() << "SPIRVComputeSanitizerPass: Nothing to check in "
+                      << F.getName() << "\n");
+
+    ++NumSkippedFunctions;
 
     return;
   }
 
-  errs() << "Shadow local memory links found:\n";
+  LLVM_DEBUG(dbgs() << "SPIRVComputeSanitizerPass: Instrumenting "
+                    << F.getName() << "\n");
 
-  for (const auto &Link : ShadowLocalMemLinks) {
-    errs() << "Shadow variable: " << *Link.ShadowVar
-           << ", Original variable: " << *Link.OriginalVar << "\n";
+  RT.ORE = &FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+  // Shadows of the local arrays this kernel uses. Helper functions cannot
+  // declare local arrays, so only kernels have them.
+  SmallVector<const ShadowLocalMemLink *, 4> KernelShadows;
+
+  if (F.getCallingConv() == CallingConv::SPIR_KERNEL) {
+    for (auto &link : RT.ShadowLocalMemLinks) {
+      if (is_used_in(*link.OriginalVar, F)) {
+        KernelShadows.push_back(&link);
+      }
+    }
+  }
+
+  // Before the epochs, which may split the block after a barrier
+  inject_barrier_checks(F, RT);
+
+  // The work-group's slice of spilled shadows, found once at entry so every
+  // check and reset can address it
+  if (any_of(RT.ShadowLocalMemLinks, [&](const auto &Link) {
+        return Link.SpillOffset && is_used_in(*Link.OriginalVar, F);
+      })) {
+    auto &Entry = F.getEntryBlock();
+    IRBuilder<> Builder(&Entry, Entry.getFirstNonPHIOrDbgOrAlloca());
+
+    RT.SpillSlice = add_sanitizer_call(
+        Builder, RT.ShadowSpillSlice,
+        {ConstantInt::get(Type::getInt64Ty(F.getContext()),
+                          RT.SpillSliceBytes)});
+  }
+
+  if (!RT.ShadowLocalMemLinks.empty()) {
+    inject_barrier_epochs(F, KernelShadows, RT);
+  }
+
+  if (!KernelShadows.empty()) {
+    // After the static allocas, which the reset must not split off the
+    // entry block, and after the spill slice it clears
+    auto &Entry = F.getEntryBlock();
+    auto InsertPt = Entry.getFirstNonPHIOrDbgOrAlloca();
+
+    if (RT.SpillSlice) {
+      InsertPt = std::next(cast<Instruction>(RT.SpillSlice)->getIterator());
+    }
+
+    IRBuilder<> Builder(&Entry, InsertPt);
+
+    auto *Entered = begin_feature_guard(Builder, FeatureLocalRaces, RT);
+
+    add_sanitizer_call(
+        Builder, RT.ShadowEnter,
+        {Builder.CreatePointerCast(
+            RT.ShadowEpochs,
+            RT.ShadowEnter.getFunctionType()->getParamType(0))});
+
+    // Leftovers in local memory may hold any epoch, so the shadows are
+    // cleared whenever the check is on
+    const auto ShadowBytes =
+        reset_shadows(Builder, KernelShadows, Builder.getInt32(1), RT);
+
+    end_feature_guard(Builder, Entered);
+    const auto &DL = F.getParent()->getDataLayout();
+    uint64_t SpilledBytes = 0;
+
+    for (const auto *Link : KernelShadows) {
+      if (Link->SpillOffset) {
+        SpilledBytes += DL.getTypeAllocSize(Link->ShadowTy).getFixedValue();
+      }
+    }
+
+    RT.ORE->emit([&] {
+      return OptimizationRemarkAnalysis(DEBUG_TYPE, "ShadowMemory",
+                                        F.getSubprogram(), &F.getEntryBlock())
+             << ore::NV("Function", &F) << " uses "
+             << ore::NV("ShadowBytes",
+                        ShadowBytes +
+                            DL.getTypeAllocSize(RT.ShadowEpochs->getValueType())
+                                .getFixedValue())
+             << " bytes of local memory for shadows and "
+             << ore::NV("SpilledBytes", SpilledBytes)
+             << " bytes of global memory, "
+             << ore::NV("LocalBytes", RT.LocalFootprints.lookup(&F))
+             << " bytes of local memory in all";
+    });
+
+    if (ClLocalMemBudget && RT.LocalFootprints.lookup(&F) > ClLocalMemBudget) {
+      RT.ORE->emit([&] {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "LocalMemBudget",
+                                        F.getSubprogram(), &F.getEntryBlock())
+               << ore::NV("Function", &F) << " needs "
+               << ore::NV("LocalBytes", RT.LocalFootprints.lookup(&F))
+               << " bytes of local memory even with every shadow spilled, "
+               << "over the budget of "
+               << ore::NV("Budget", uint64_t(ClLocalMemBudget)) << " bytes";
+      });
+    }
+  }
+
+  // The barrier checks, epochs and shadow resets above split blocks. The
+  // analyses below must not reuse results computed for the old CFG, e.g.
+  // cached by the -O2 pipeline when running at optimizer-last.
+  FAM.invalidate(F, PreservedAnalyses::none());
+
+  auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+  RT.ORE = &ORE;
+
+  if (!ArraySizeLinks.empty() && !F.hasOptNone() &&
+      (ClProveInBounds || ClHoistLoopChecks || ClEliminateRedundantChecks ||
+       ClVersionLoops)) {
+    promote_allocas(F, FAM.getResult<DominatorTreeAnalysis>(F),
+                    FAM.getResult<AssumptionAnalysis>(F));
+  }
+
+  SmallPtrSet<const Instruction *, 16> ProvenGEPs;
+
+  if (ClProveInBounds && !ArraySizeLinks.empty()) {
+    annotate_work_item_ranges(F);
+
+    ProvenGEPs = prove_in_bounds_geps(
+        F, FAM.getResult<ScalarEvolutionAnalysis>(F),
+        FAM.getResult<AssumptionAnalysis>(F),
+        FAM.getResult<DominatorTreeAnalysis>(F),
+        ORE, ArraySizeLinks);
+  }
+
+  Value *BoundsEnabled = nullptr;
+
+  if (!ArraySizeLinks.empty()) {
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+
+    BoundsEnabled = create_feature_enabled(EntryBuilder, FeatureBounds, RT);
+  }
+
+  // ArrayIndexOutOfBounds: Check loop accesses once before the loop and
+  // drop checks already covered on every path
+  LoopCheckPlan LoopChecks;
+  BoundsCheckCache CheckCache;
+  ScalarEvolution *RangeSE = nullptr;
+
+  if (ClHoistLoopChecks || ClEliminateRedundantChecks || ClVersionLoops) {
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+    SmallVector<LoopVersion, 4> Versions;
+
+    if (ClHoistLoopChecks) {
+      LoopChecks = plan_loop_checks(F, LI, DT, SE, ArraySizeLinks, ProvenGEPs,
+                                    ORE);
+    }
+
+    if (ClVersionLoops && !ArraySizeLinks.empty()) {
+      Versions = plan_loop_versions(LI, SE, ArraySizeLinks, LoopChecks,
+                                    ProvenGEPs, ORE);
+    }
+
+    if (ClEliminateRedundantChecks) {
+      CheckCache = build_check_cache(F, DT, SE, ArraySizeLinks, LoopChecks,
+                                     ProvenGEPs, ORE);
+      RangeSE = &SE;
+    }
+
+    // After the cache, which must only see the checked copies, and before
+    // the hoisted checks split the preheaders it branches in
+    version_loops(F, Versions, LI, DT, SE, BoundsEnabled, LoopChecks, ORE);
+    inject_loop_checks(F, SE, LoopChecks, BoundsEnabled, RT);
+  }
+
+  auto Targets =
+      collect_instrumentation_targets(F, RT.ShadowLocalMemLinks, ArraySizeLinks,
+                                      LoopChecks, CheckCache, ProvenGEPs);
+
+  if (RangeSE) {
+    merge_range_accesses(Targets.Ranges, *RangeSE, ORE);
+  }
+
+  strip_work_item_ranges(F);
+
+  inject_checks(F, Targets, ArraySizeLinks, CheckCache, BoundsEnabled, RT);
+
+  if (ClGlobalRaces) {
+    inject_global_write_checks(F, RT);
   }
+
+  if (ClOnError == ErrorAction::Abort) {
+    inject_poison_checks(F, RT);
+  }
+
+  LLVM_DEBUG(print_array_links(ArraySizeLinks));
+
+  // Analyses of F are stale from here on
+  RT.ORE = nullptr;
+  RT.SpillSlice = nullptr;
+  FAM.invalidate(F, PreservedAnalyses::none());
 }
 
-static void
-print_array_links(const std::vector<ArraySizeLink> &ArraySizeLinks) {
-  if (ArraySizeLinks.empty()) {
-    errs() << "No array links found.\n";
+// Copy every function before instrumentation. Calls inside the copies are
+// redirected to the other copies, so unsampled work-groups never reach a
+// check.
+static DenseMap<Function *, Function *>
+create_unchecked_clones(ArrayRef<Function *> Functions) {
+  DenseMap<Function *, Function *> Clones;
 
-    return;
+  for (auto *F : Functions) {
+    ValueToValueMapTy VMap;
+    auto *Clone = CloneFunction(F, VMap);
+
+    Clone->setName(F->getName() + ".unchecked");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    Clone->setCallingConv(CallingConv::SPIR_FUNC);
+
+    Clones[F] = Clone;
   }
 
-  errs() << "Array links found:\n";
+  for (auto &[F, Clone] : Clones) {
+    for (auto &Inst : instructions(*Clone)) {
+      auto *Call = dyn_cast<CallInst>(&Inst);
+      auto *Callee = Call ? Call->getCalledFunction() : nullptr;
 
-  for (const auto &[ArrayArg, SizeArg] : ArraySizeLinks) {
-    if (ArrayArg->getType()->isPointerTy()) {
-      errs() << "Array argument: " << *ArrayArg
-             << ", Size argument: " << *SizeArg << "\n";
-    } else {
-      errs() << "Invalid link found: " << *ArrayArg << "\n";
+      if (auto *CalleeClone = Callee ? Clones.lookup(Callee) : nullptr) {
+        Call->setCalledFunction(CalleeClone);
+      }
+    }
+  }
+
+  return Clones;
+}
+
+// Run the unchecked clone of the kernel in work-groups the runtime does not
+// sample. The decision is uniform across the work-group.
+static void inject_sampling_dispatch(Function &Kernel, Function &Clone,
+                                     SanitizerRuntime &RT) {
+  auto &OldEntry = Kernel.getEntryBlock();
+  auto *Entry = BasicBlock::Create(Kernel.getContext(), "", &Kernel, &OldEntry);
+  auto *Unchecked = BasicBlock::Create(Kernel.getContext(), "", &Kernel);
+
+  // Static allocas have to stay in the entry block
+  for (auto &Inst : make_early_inc_range(OldEntry)) {
+    if (auto *Alloca = dyn_cast<AllocaInst>(&Inst);
+        Alloca && Alloca->isStaticAlloca()) {
+      Alloca->moveBefore(*Entry, Entry->end());
     }
   }
+
+  IRBuilder<> Builder(Entry);
+
+  auto *Sampled = add_sanitizer_call(Builder, RT.SampleWorkGroup, {});
+
+  Builder.CreateCondBr(Builder.CreateIsNotNull(Sampled), &OldEntry, Unchecked);
+
+  IRBuilder<> UncheckedBuilder(Unchecked);
+  SmallVector<Value *, 8> Args;
+
+  for (auto &Arg : Kernel.args()) {
+    Args.push_back(&Arg);
+  }
+
+  auto *Call = UncheckedBuilder.CreateCall(&Clone, Args);
+  Call->setCallingConv(CallingConv::SPIR_FUNC);
+
+  UncheckedBuilder.CreateRetVoid();
 }
 
-PreservedAnalyses SPIRVComputeSanitizerPass::run(Function &F,
-                                                 FunctionAnalysisManager &FAM) {
-  if (const Module *M = F.getParent(); !should_run(*M)) {
-    errs() << "SPIRVComputeSanitizerPass: Not running on non-SPIR-V module\n";
+PreservedAnalyses SPIRVComputeSanitizerPass::run(Module &M,
+                                                 ModuleAnalysisManager &MAM) {
+  if (!should_run(M)) {
+    LLVM_DEBUG(dbgs() << "SPIRVComputeSanitizerPass: Not running on "
+                         "non-SPIR-V module\n");
 
     return PreservedAnalyses::all(); // Don't run if not SPIR-V
   }
 
-  errs() << "SPIRVComputeSanitizerPass: Running on SPIR-V module\n";
+  LLVM_DEBUG(dbgs() << "SPIRVComputeSanitizerPass: Running on SPIR-V module\n");
 
-  setup_extern_functions(*F.getParent());
+  auto RT = get_sanitizer_runtime(M);
 
-  // LocalMemoryConflict: Allocate shadow local memory
-  std::vector<ShadowLocalMemLink> ShadowLocalMemLinks =
-      find_shadow_local_mem_links(F);
+  LLVM_DEBUG(print_shadow_links(RT.ShadowLocalMemLinks));
+
+  if (ClPropagateArraySizes) {
+    propagate_array_sizes(M, RT);
+  }
 
-  // Add libscsan_shadow_memset(shadowVar, size, 0) call
-  for (auto &link : ShadowLocalMemLinks) {
-    IRBuilder<> Builder(F.getContext());
-    Builder.SetInsertPoint(&F.getEntryBlock().front());
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
 
-    add_sanitizer_call(
-        Builder, "libscsan_shadow_memset",
-        {Builder.CreatePointerCast(link.ShadowVar, link.ShadowVar->getType()),
-         ConstantInt::get(
-             Type::getInt64Ty(F.getContext()),
-             link.ShadowVar->getValueType()->getArrayNumElements()),
-         ConstantInt::get(Type::getInt64Ty(F.getContext()), 0)});
+  SmallVector<Function *, 16> Functions;
+
+  for (auto &F : M) {
+    if (!F.isDeclaration()) {
+      Functions.push_back(&F);
+    }
+  }
+
+  if (ClCheckBarriers) {
+    plan_barrier_checks(M, Functions, FAM, RT);
   }
 
-  std::vector<ArraySizeLink> ArraySizeLinks = find_array_size_links(F);
+  DenseMap<Function *, Function *> Clones;
 
-  auto &Block = F.getEntryBlock();
+  if (ClSampleWorkGroups) {
+    Clones = create_unchecked_clones(Functions);
+  }
 
-  TraverseContext TraverseCtx{F, ShadowLocalMemLinks, ArraySizeLinks};
+  for (auto *F : Functions) {
+    instrument_function(*F, FAM, RT);
 
-  traverse(Block, TraverseCtx);
+    if (ClSampleWorkGroups && F->getCallingConv() == CallingConv::SPIR_KERNEL) {
+      inject_sampling_dispatch(*F, *Clones[F], RT);
 
-  errs() << "\n";
+      FAM.invalidate(*F, PreservedAnalyses::none());
+    }
+  }
 
-  print_shadow_links(ShadowLocalMemLinks);
-  print_array_links(ArraySizeLinks);
+  if (ClOnError != ErrorAction::Recover) {
+    inject_stop_checks(RT);
+  }
 
-  return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
 }
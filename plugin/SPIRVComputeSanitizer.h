@@ -8,7 +8,7 @@ namespace llvm {
 class SPIRVComputeSanitizerPass
     : public PassInfoMixin<SPIRVComputeSanitizerPass> {
 public:
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
 
   static bool isRequired() { return true; }
 };
@@ -0,0 +1,35 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -pass-remarks=spirv-compute-sanitizer -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+
+; c[id] += 1 at pipeline-start: both accesses reload id from its alloca, and
+; the store is still covered by the check of the load.
+
+; CHECK: bounds check of c covered by a dominating check
+; CHECK-COUNT-1: index out of bounds check
+; CHECK-NOT: index out of bounds check
+
+target triple = "spirv64-unknown-unknown"
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+
+define spir_kernel void @increment(ptr addrspace(1) %c, i64 %c_size) {
+entry:
+  %c.addr = alloca ptr addrspace(1)
+  %c_size.addr = alloca i64
+  %id = alloca i64
+  store ptr addrspace(1) %c, ptr %c.addr
+  store i64 %c_size, ptr %c_size.addr
+  %call = call spir_func i64 @_Z13get_global_idj(i32 0)
+  store i64 %call, ptr %id
+  %0 = load ptr addrspace(1), ptr %c.addr
+  %1 = load i64, ptr %id
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %0, i64 %1
+  %2 = load float, ptr addrspace(1) %arrayidx
+  %add = fadd float %2, 1.000000e+00
+  %3 = load ptr addrspace(1), ptr %c.addr
+  %4 = load i64, ptr %id
+  %arrayidx1 = getelementptr inbounds float, ptr addrspace(1) %3, i64 %4
+  store float %add, ptr addrspace(1) %arrayidx1
+  ret void
+}
@@ -0,0 +1,41 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -scsan-global-races -S %s | FileCheck %s
+
+; a[gid] = 1; barrier(CLK_GLOBAL_MEM_FENCE); a[gid + 1] = 2;
+; barrier(CLK_LOCAL_MEM_FENCE); b[gid] = 3;
+; Byte stores get byte granules, so neighbouring work-items do not share a
+; slot, while int stores keep the default 4 bytes. Only the barrier fencing
+; global memory starts a new phase, which orders the two writes to a within
+; a work-group.
+
+; CHECK: call spir_func void @libscsan_global_enter(ptr addrspace(3) @libscsan.global.phases)
+; CHECK: call spir_func void @libscsan_global_write(ptr addrspace(1) %p, i32 1, i32 0, i32 {{[0-9]+}}, ptr addrspace(3) @libscsan.global.phases)
+; CHECK: store i8 1, ptr addrspace(1) %p
+; CHECK-NEXT: call spir_func void @_Z7barrierj(i32 2)
+; CHECK: call spir_func void @libscsan_global_barrier(ptr addrspace(3) @libscsan.global.phases)
+; CHECK: call spir_func void @libscsan_global_write(ptr addrspace(1) %q, i32 1, i32 0,
+; CHECK: store i8 2, ptr addrspace(1) %q
+; CHECK-NEXT: call spir_func void @_Z7barrierj(i32 1)
+; CHECK-NOT: @libscsan_global_barrier
+; CHECK: call spir_func void @libscsan_global_write(ptr addrspace(1) %r, i32 4, i32 2,
+; CHECK: store i32 3, ptr addrspace(1) %r
+
+target triple = "spirv64-unknown-unknown"
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+declare spir_func void @_Z7barrierj(i32)
+
+define spir_kernel void @shift(ptr addrspace(1) %a, ptr addrspace(1) %b) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %p = getelementptr inbounds i8, ptr addrspace(1) %a, i64 %gid
+  store i8 1, ptr addrspace(1) %p
+  call spir_func void @_Z7barrierj(i32 2)
+  %next = add i64 %gid, 1
+  %q = getelementptr inbounds i8, ptr addrspace(1) %a, i64 %next
+  store i8 2, ptr addrspace(1) %q
+  call spir_func void @_Z7barrierj(i32 1)
+  %r = getelementptr inbounds i32, ptr addrspace(1) %b, i64 %gid
+  store i32 3, ptr addrspace(1) %r
+  ret void
+}
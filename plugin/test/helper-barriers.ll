@@ -0,0 +1,84 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer -S %s \
+; RUN:   | FileCheck %s
+
+; void sync_group(long n) { if (n) barrier(CLK_LOCAL_MEM_FENCE); }
+; void sync_item(long n) { if (n) barrier(CLK_LOCAL_MEM_FENCE); }
+; uniform: sync_group(get_group_id(0));
+; early: barrier(CLK_LOCAL_MEM_FENCE); sync_item(get_global_id(0));
+; late: sync_item(get_global_id(0));
+; Every call of sync_group passes a uniform value, so its barrier is not
+; checked. The barrier early starts with publishes the reset of the arrival
+; count, late needs one of its own.
+
+; CHECK-LABEL: define spir_func void @sync_group(
+; CHECK-NOT: @libscsan_barrier_arrive
+; CHECK: ret void
+
+; CHECK-LABEL: define spir_kernel void @uniform(
+; CHECK-NOT: @libscsan_barrier_enter
+; CHECK: ret void
+
+; CHECK-LABEL: define spir_func void @sync_item(
+; CHECK: call spir_func i32 @libscsan_barrier_arrive(
+; CHECK: call spir_func void @_Z7barrierj(i32 1)
+; CHECK: call spir_func void @libscsan_barrier_check(
+
+; CHECK-LABEL: define spir_kernel void @early(
+; CHECK: call spir_func void @libscsan_barrier_enter(ptr addrspace(3) @libscsan.barrier.arrivals, i32 0)
+
+; CHECK-LABEL: define spir_kernel void @late(
+; CHECK: call spir_func void @libscsan_barrier_enter(ptr addrspace(3) @libscsan.barrier.arrivals, i32 1)
+
+target triple = "spirv64-unknown-unknown"
+
+declare spir_func i64 @_Z12get_group_idj(i32)
+declare spir_func i64 @_Z13get_global_idj(i32)
+declare spir_func void @_Z7barrierj(i32)
+
+define spir_func void @sync_group(i64 %n) {
+entry:
+  %set = icmp ne i64 %n, 0
+  br i1 %set, label %if.then, label %if.end
+
+if.then:
+  call spir_func void @_Z7barrierj(i32 1)
+  br label %if.end
+
+if.end:
+  ret void
+}
+
+define spir_kernel void @uniform() {
+entry:
+  %group = call spir_func i64 @_Z12get_group_idj(i32 0)
+  call spir_func void @sync_group(i64 %group)
+  ret void
+}
+
+define spir_func void @sync_item(i64 %n) {
+entry:
+  %set = icmp ne i64 %n, 0
+  br i1 %set, label %if.then, label %if.end
+
+if.then:
+  call spir_func void @_Z7barrierj(i32 1)
+  br label %if.end
+
+if.end:
+  ret void
+}
+
+define spir_kernel void @early() {
+entry:
+  call spir_func void @_Z7barrierj(i32 1)
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  call spir_func void @sync_item(i64 %gid)
+  ret void
+}
+
+define spir_kernel void @late() {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  call spir_func void @sync_item(i64 %gid)
+  ret void
+}
@@ -0,0 +1,41 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -pass-remarks=spirv-compute-sanitizer -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+
+; Front end output, as the pass sees it at pipeline-start: the counter lives
+; in an alloca and the loop exits at its header. The check of a[i] is still
+; done once in the preheader.
+
+; CHECK: bounds check of a hoisted out of the loop
+; CHECK-COUNT-1: index out of bounds check
+; CHECK-NOT: index out of bounds check
+
+target triple = "spirv64-unknown-unknown"
+
+define spir_kernel void @fill(ptr addrspace(1) %a, i64 %a_size) {
+entry:
+  %a.addr = alloca ptr addrspace(1)
+  %a_size.addr = alloca i64
+  %i = alloca i64
+  store ptr addrspace(1) %a, ptr %a.addr
+  store i64 %a_size, ptr %a_size.addr
+  store i64 0, ptr %i
+  br label %for.cond
+
+for.cond:
+  %0 = load i64, ptr %i
+  %cmp = icmp ult i64 %0, 16
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %1 = load ptr addrspace(1), ptr %a.addr
+  %2 = load i64, ptr %i
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %1, i64 %2
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  %inc = add nuw nsw i64 %2, 1
+  store i64 %inc, ptr %i
+  br label %for.cond
+
+for.end:
+  ret void
+}
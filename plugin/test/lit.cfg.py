@@ -0,0 +1,13 @@
+import os
+
+import lit.formats
+
+config.name = "spirv-compute-sanitizer"
+config.test_format = lit.formats.ShTest(True)
+config.suffixes = [".ll"]
+config.test_source_root = os.path.dirname(__file__)
+
+# opt and FileCheck of the LLVM the plugin is built against
+config.environment["PATH"] = os.pathsep.join(
+    [lit_config.params["llvm_tools"], config.environment.get("PATH", "")])
+config.substitutions.append(("%plugin", lit_config.params["plugin"]))
@@ -0,0 +1,67 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer -S %s \
+; RUN:   | FileCheck %s
+
+; tile[lid] = 0; tile[2 * lid + 1] = 1; tile[lid / 2] = 2; other[lid / 2] = 3;
+; grid[ly * 16 + lx] = 4; grid[ly * 8 + lx] = 5;
+; Stores whose index is injective in the local ids are stamped with an
+; exchange, the rest are claimed. Work-groups of 64 fit 16-bit cells, but
+; arrays with stamped stores get 32-bit cells, which the exchange needs.
+
+; CHECK-LABEL: define spir_kernel void @rows(
+; CHECK: call spir_func i32 @libscsan_shadow_stamp_u32(
+; CHECK: store float 0.000000e+00, ptr addrspace(3) %own
+; CHECK: call spir_func i32 @libscsan_shadow_stamp_u32(
+; CHECK: store float 1.000000e+00, ptr addrspace(3) %spread
+; CHECK: call spir_func i32 @libscsan_shadow_claim_u32(
+; CHECK: store float 2.000000e+00, ptr addrspace(3) %shared
+; CHECK: call spir_func i16 @libscsan_shadow_claim_u16(
+; CHECK: store float 3.000000e+00, ptr addrspace(3) %other.shared
+
+; CHECK-LABEL: define spir_kernel void @grid(
+; CHECK: call spir_func i32 @libscsan_shadow_stamp_u32(
+; CHECK: store float 4.000000e+00, ptr addrspace(3) %cell
+; CHECK: call spir_func i32 @libscsan_shadow_claim_u32(
+; CHECK: store float 5.000000e+00, ptr addrspace(3) %overlap
+
+target triple = "spirv64-unknown-unknown"
+
+@tile = internal addrspace(3) global [128 x float] undef, align 4
+@other = internal addrspace(3) global [64 x float] undef, align 4
+@grid.tile = internal addrspace(3) global [64 x float] undef, align 4
+
+declare spir_func i64 @_Z12get_local_idj(i32)
+
+define spir_kernel void @rows() !reqd_work_group_size !0 {
+entry:
+  %lid = call spir_func i64 @_Z12get_local_idj(i32 0)
+  %own = getelementptr inbounds [128 x float], ptr addrspace(3) @tile, i64 0, i64 %lid
+  store float 0.000000e+00, ptr addrspace(3) %own
+  %twice = shl i64 %lid, 1
+  %odd = add i64 %twice, 1
+  %spread = getelementptr inbounds [128 x float], ptr addrspace(3) @tile, i64 0, i64 %odd
+  store float 1.000000e+00, ptr addrspace(3) %spread
+  %half = udiv i64 %lid, 2
+  %shared = getelementptr inbounds [128 x float], ptr addrspace(3) @tile, i64 0, i64 %half
+  store float 2.000000e+00, ptr addrspace(3) %shared
+  %other.shared = getelementptr inbounds [64 x float], ptr addrspace(3) @other, i64 0, i64 %half
+  store float 3.000000e+00, ptr addrspace(3) %other.shared
+  ret void
+}
+
+define spir_kernel void @grid() !reqd_work_group_size !1 {
+entry:
+  %lx = call spir_func i64 @_Z12get_local_idj(i32 0)
+  %ly = call spir_func i64 @_Z12get_local_idj(i32 1)
+  %row = mul i64 %ly, 16
+  %index = add i64 %row, %lx
+  %cell = getelementptr inbounds [64 x float], ptr addrspace(3) @grid.tile, i64 0, i64 %index
+  store float 4.000000e+00, ptr addrspace(3) %cell
+  %narrow = mul i64 %ly, 8
+  %folded = add i64 %narrow, %lx
+  %overlap = getelementptr inbounds [64 x float], ptr addrspace(3) @grid.tile, i64 0, i64 %folded
+  store float 5.000000e+00, ptr addrspace(3) %overlap
+  ret void
+}
+
+!0 = !{i32 64, i32 1, i32 1}
+!1 = !{i32 16, i32 4, i32 1}
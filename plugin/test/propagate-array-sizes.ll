@@ -0,0 +1,51 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer -S %s \
+; RUN:   | FileCheck %s
+
+; put(i, a) is only called with a linked array, so it gets a copy taking the
+; size and a check. set(i, p) is also called with b, which has no size, so it
+; keeps its signature and stays unchecked.
+
+; CHECK-LABEL: define spir_kernel void @linked(
+; CHECK: call spir_func void @put.sized(i64 %i, ptr addrspace(1) %a, i64 %a_size)
+; CHECK: call spir_func void @set(i64 %i, ptr addrspace(1) %a)
+
+; CHECK-LABEL: define spir_kernel void @unlinked(
+; CHECK: call spir_func void @set(i64 %i, ptr addrspace(1) %b)
+
+; CHECK-LABEL: define internal spir_func void @set(i64 %i, ptr addrspace(1) %p)
+; CHECK-NOT: icmp
+; CHECK: ret void
+
+; CHECK-LABEL: define internal spir_func void @put.sized(i64 %i, ptr addrspace(1) %p, i64 %p.size)
+; CHECK: icmp ult i64 %i, %p.size
+
+; CHECK-NOT: define {{.*}} @put(
+
+target triple = "spirv64-unknown-unknown"
+
+define spir_kernel void @linked(ptr addrspace(1) %a, i64 %a_size, i64 %i) {
+entry:
+  call spir_func void @put(i64 %i, ptr addrspace(1) %a)
+  call spir_func void @set(i64 %i, ptr addrspace(1) %a)
+  ret void
+}
+
+define spir_kernel void @unlinked(ptr addrspace(1) %b, i64 %i) {
+entry:
+  call spir_func void @set(i64 %i, ptr addrspace(1) %b)
+  ret void
+}
+
+define internal spir_func void @set(i64 %i, ptr addrspace(1) %p) {
+entry:
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %p, i64 %i
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  ret void
+}
+
+define internal spir_func void @put(i64 %i, ptr addrspace(1) %p) {
+entry:
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %p, i64 %i
+  store float 1.000000e+00, ptr addrspace(1) %arrayidx
+  ret void
+}
@@ -0,0 +1,45 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -pass-remarks=spirv-compute-sanitizer -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+
+; if (id < a_size) a[id] = 0;   proven, no check
+; if (id <= b_size) b[id] = 0;  id == b_size is out of bounds, checked
+
+; CHECK: bounds check of a elided: index proven smaller than a_size
+; CHECK-NOT: proven smaller than b_size
+; CHECK-COUNT-1: index out of bounds check
+; CHECK-NOT: index out of bounds check
+
+target triple = "spirv64-unknown-unknown"
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+
+define spir_kernel void @guarded(ptr addrspace(1) %a, i64 %a_size) {
+entry:
+  %id = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %in = icmp ult i64 %id, %a_size
+  br i1 %in, label %if.then, label %if.end
+
+if.then:
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %a, i64 %id
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  br label %if.end
+
+if.end:
+  ret void
+}
+
+define spir_kernel void @off_by_one(ptr addrspace(1) %b, i64 %b_size) {
+entry:
+  %id = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %in = icmp ule i64 %id, %b_size
+  br i1 %in, label %if.then, label %if.end
+
+if.then:
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %b, i64 %id
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  br label %if.end
+
+if.end:
+  ret void
+}
@@ -0,0 +1,35 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer -S %s \
+; RUN:   | FileCheck %s
+
+; s[i - 1].last = 0;
+; With i == 0 the offset is -4 and offset + 4 wraps to 0, which is below
+; any limit, so the check must also require the access to end after it
+; starts.
+
+; CHECK: [[OFFSET:%[0-9]+]] = add i64 %{{[0-9]+}}, 4
+; CHECK-NEXT: [[END:%[0-9]+]] = add i64 [[OFFSET]], 4
+; CHECK-NEXT: [[LIMIT:%[0-9]+]] = mul i64 %{{.*}}, 8
+; CHECK-NEXT: [[NOWRAP:%[0-9]+]] = icmp ule i64 [[OFFSET]], [[END]]
+; CHECK-NEXT: [[BELOW:%[0-9]+]] = icmp ule i64 [[END]], [[LIMIT]]
+; CHECK-NEXT: and i1 [[NOWRAP]], [[BELOW]]
+
+target triple = "spirv64-unknown-unknown"
+
+%struct.S = type { i32, i32 }
+
+define spir_kernel void @last(ptr addrspace(1) %s, i64 %s_size, i64 %i) {
+entry:
+  %s.addr = alloca ptr addrspace(1)
+  %s_size.addr = alloca i64
+  %i.addr = alloca i64
+  store ptr addrspace(1) %s, ptr %s.addr
+  store i64 %s_size, ptr %s_size.addr
+  store i64 %i, ptr %i.addr
+  %0 = load ptr addrspace(1), ptr %s.addr
+  %1 = load i64, ptr %i.addr
+  %sub = sub i64 %1, 1
+  %arrayidx = getelementptr inbounds %struct.S, ptr addrspace(1) %0, i64 %sub
+  %last = getelementptr inbounds %struct.S, ptr addrspace(1) %arrayidx, i32 0, i32 1
+  store i32 0, ptr addrspace(1) %last
+  ret void
+}
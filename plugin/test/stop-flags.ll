@@ -0,0 +1,54 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -scsan-on-error=return -S %s | FileCheck %s
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -scsan-on-error=return -scsan-propagate-array-sizes=false -S %s \
+; RUN:   | FileCheck %s --check-prefix=NOSTOP
+
+; void put(long i, global float *p) { p[i] = 0; }
+; void noop(void) {}
+; calls: put(i, a);  plain: noop();
+; Only put gets a check once it receives the size of a, so only it can stop,
+; and only calls reaching it poll the stop flag. Without the size nothing
+; can stop and the flags are not allocated at all.
+
+; CHECK: @libscsan.stopped = internal addrspace(3) global
+
+; CHECK-LABEL: define spir_kernel void @calls(
+; CHECK: store i8 0, ptr addrspace(3)
+; CHECK: call spir_func void @put.sized(
+; CHECK: load i8, ptr addrspace(3)
+
+; CHECK-LABEL: define spir_kernel void @plain(
+; CHECK-NOT: addrspace(3)
+; CHECK: ret void
+
+; CHECK-LABEL: define internal spir_func void @put.sized(
+; CHECK: store i8 1, ptr addrspace(3)
+
+; NOSTOP-NOT: addrspace(3)
+
+target triple = "spirv64-unknown-unknown"
+
+define spir_kernel void @calls(ptr addrspace(1) %a, i64 %a_size, i64 %i) {
+entry:
+  call spir_func void @put(i64 %i, ptr addrspace(1) %a)
+  ret void
+}
+
+define spir_kernel void @plain() {
+entry:
+  call spir_func void @noop()
+  ret void
+}
+
+define spir_func void @put(i64 %i, ptr addrspace(1) %p) {
+entry:
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %p, i64 %i
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  ret void
+}
+
+define spir_func void @noop() {
+entry:
+  ret void
+}
@@ -0,0 +1,56 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer -S %s \
+; RUN:   | FileCheck %s
+
+; *(c ? &a[i] : &a[j]) = 0;  both paths start at a, checked by address
+; *(c ? &a[i] : &b[i]) = 0;  the array is only known at run time, unchecked
+
+; CHECK-LABEL: define spir_kernel void @pick(
+; CHECK-DAG: [[ADDR:%[0-9]+]] = ptrtoint ptr addrspace(1) %r to i64
+; CHECK-DAG: [[BASE:%[0-9]+]] = ptrtoint ptr addrspace(1) %a to i64
+; CHECK: sub i64 [[ADDR]], [[BASE]]
+; CHECK: store float 0.000000e+00, ptr addrspace(1) %r
+
+; CHECK-LABEL: define spir_kernel void @either(
+; CHECK-NOT: ptrtoint
+; CHECK: store float 0.000000e+00, ptr addrspace(1) %r
+
+target triple = "spirv64-unknown-unknown"
+
+define spir_kernel void @pick(ptr addrspace(1) %a, i64 %a_size, i64 %i,
+                              i64 %j, i1 %c) {
+entry:
+  br i1 %c, label %left, label %right
+
+left:
+  %p = getelementptr inbounds float, ptr addrspace(1) %a, i64 %i
+  br label %join
+
+right:
+  %q = getelementptr inbounds float, ptr addrspace(1) %a, i64 %j
+  br label %join
+
+join:
+  %r = phi ptr addrspace(1) [ %p, %left ], [ %q, %right ]
+  store float 0.000000e+00, ptr addrspace(1) %r
+  ret void
+}
+
+define spir_kernel void @either(ptr addrspace(1) %a, i64 %a_size,
+                                ptr addrspace(1) %b, i64 %b_size, i64 %i,
+                                i1 %c) {
+entry:
+  br i1 %c, label %left, label %right
+
+left:
+  %p = getelementptr inbounds float, ptr addrspace(1) %a, i64 %i
+  br label %join
+
+right:
+  %q = getelementptr inbounds float, ptr addrspace(1) %b, i64 %i
+  br label %join
+
+join:
+  %r = phi ptr addrspace(1) [ %p, %left ], [ %q, %right ]
+  store float 0.000000e+00, ptr addrspace(1) %r
+  ret void
+}
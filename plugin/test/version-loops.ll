@@ -0,0 +1,55 @@
+; RUN: opt -load-pass-plugin=%plugin -passes=spirv-compute-sanitizer \
+; RUN:   -scsan-version-loops -pass-remarks=spirv-compute-sanitizer -S %s \
+; RUN:   2>&1 | FileCheck %s
+
+; for (i = 0; i < n; i++) if (i & 1) a[i] = 0;
+; The store does not run on every iteration, so its check cannot be
+; reported before the loop, but the loop gets an unchecked copy behind a
+; test of a[n - 1].
+
+; CHECK: loop versioned: 1 bounds checks skipped when the range test passes
+; CHECK: br i1 %{{.*}}, label %for.cond.checked.fast, label %for.cond.checked
+; CHECK: for.cond.fast:
+
+target triple = "spirv64-unknown-unknown"
+
+define spir_kernel void @odd(ptr addrspace(1) %a, i64 %a_size, i64 %n) {
+entry:
+  %a.addr = alloca ptr addrspace(1)
+  %a_size.addr = alloca i64
+  %n.addr = alloca i64
+  %i = alloca i64
+  store ptr addrspace(1) %a, ptr %a.addr
+  store i64 %a_size, ptr %a_size.addr
+  store i64 %n, ptr %n.addr
+  store i64 0, ptr %i
+  br label %for.cond
+
+for.cond:
+  %0 = load i64, ptr %i
+  %1 = load i64, ptr %n.addr
+  %cmp = icmp ult i64 %0, %1
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %2 = load i64, ptr %i
+  %and = and i64 %2, 1
+  %tobool = icmp ne i64 %and, 0
+  br i1 %tobool, label %if.then, label %for.inc
+
+if.then:
+  %3 = load ptr addrspace(1), ptr %a.addr
+  %4 = load i64, ptr %i
+  %arrayidx = getelementptr inbounds float, ptr addrspace(1) %3, i64 %4
+  store float 0.000000e+00, ptr addrspace(1) %arrayidx
+  br label %for.inc
+
+for.inc:
+  %5 = load i64, ptr %i
+  %inc = add nuw nsw i64 %5, 1
+  store i64 %inc, ptr %i
+  br label %for.cond
+
+for.end:
+  ret void
+}
@@ -6,6 +6,10 @@
 #include <string.h>
 
 #include "cl.h"
+#include "global_shadow.h"
+#include "report.h"
+#include "sample.h"
+#include "shadow_spill.h"
 
 #define ARRAY_SIZE 8
 
@@ -136,12 +140,59 @@ int main(const int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  if (init_sample_rate(&ctx) != 0) {
+    fprintf(stderr, "Failed to set sanitizer sample rate.\n");
+
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  ReportBuffer reports = {0};
+
+  if (init_report_buffer(&ctx, &reports) != 0) {
+    fprintf(stderr, "Failed to initialize sanitizer report buffer.\n");
+
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  GlobalShadow shadow = {0};
+
+  if (init_global_shadow(&ctx, &shadow) != 0) {
+    fprintf(stderr, "Failed to initialize sanitizer global shadow.\n");
+
+    clean_global_shadow(&ctx, &shadow);
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  ShadowSpill spill = {0};
+
+  if (init_shadow_spill(&ctx, &spill) != 0) {
+    fprintf(stderr, "Failed to initialize sanitizer shadow spill.\n");
+
+    clean_shadow_spill(&ctx, &spill);
+    clean_global_shadow(&ctx, &shadow);
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
   OpenCLBuffers buffers = {0};
 
   if (init_opencl_buffers(&ctx, &buffers) != 0) {
     fprintf(stderr, "Failed to initialize OpenCL buffers.\n");
 
     clean_opencl_buffers(&buffers);
+    clean_shadow_spill(&ctx, &spill);
+    clean_global_shadow(&ctx, &shadow);
+    clean_report_buffer(&reports);
     clean_opencl_context(&ctx);
 
     return EXIT_FAILURE;
@@ -157,15 +208,25 @@ int main(const int argc, char **argv) {
     fprintf(stderr, "Kernel execution failed.\n");
 
     clean_opencl_buffers(&buffers);
+    clean_shadow_spill(&ctx, &spill);
+    clean_global_shadow(&ctx, &shadow);
+    clean_report_buffer(&reports);
     clean_opencl_context(&ctx);
 
     return EXIT_FAILURE;
   }
 
+  if (read_reports(&ctx, &reports) != 0) {
+    fprintf(stderr, "Failed to read sanitizer reports.\n");
+  }
+
   printf("Output array:\n");
   print_array("c", ARRAY_SIZE, buffers.h_c);
 
   clean_opencl_buffers(&buffers);
+  clean_shadow_spill(&ctx, &spill);
+  clean_global_shadow(&ctx, &shadow);
+  clean_report_buffer(&reports);
   clean_opencl_context(&ctx);
 
   return EXIT_SUCCESS;
@@ -0,0 +1,222 @@
+// bench-local-store: run(in, out, STORES_PER_ITEM) を繰り返し実行し、
+// ローカルメモリへのアクセス数/秒を計測します。kernel/bench-local-store.cl
+// および kernel/bench-local-load.cl 用です。
+// 第2引数で実行回数を指定できます (デフォルト 100)。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cl.h"
+#include "report.h"
+#include "sample.h"
+#include "shadow_spill.h"
+
+#define GLOBAL_SIZE (256 * 256)
+#define LOCAL_SIZE 256
+#define STORES_PER_ITEM 1024
+
+typedef struct {
+  int h_in[GLOBAL_SIZE];
+  cl_mem d_in;
+  cl_mem d_out;
+} OpenCLBuffers;
+
+int init_opencl_buffers(OpenCLContext *ctx, OpenCLBuffers *buffers) {
+  cl_int err;
+
+  for (int i = 0; i < GLOBAL_SIZE; ++i) {
+    buffers->h_in[i] = i;
+  }
+
+  const size_t buffer_size = sizeof(int) * GLOBAL_SIZE;
+
+  // Create buffers
+  buffers->d_in =
+      clCreateBuffer(ctx->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     buffer_size, buffers->h_in, &err);
+  CHECK_CL_ERROR(err, "Error in creating input buffer");
+
+  buffers->d_out =
+      clCreateBuffer(ctx->context, CL_MEM_WRITE_ONLY, buffer_size, NULL, &err);
+  CHECK_CL_ERROR(err, "Error in creating output buffer");
+
+  return 0;
+}
+
+void clean_opencl_buffers(OpenCLBuffers *buffers) {
+  if (buffers->d_in)
+    clReleaseMemObject(buffers->d_in);
+  if (buffers->d_out)
+    clReleaseMemObject(buffers->d_out);
+
+  memset(buffers, 0, sizeof(OpenCLBuffers));
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int run_kernel(OpenCLContext *ctx, OpenCLBuffers *buffers, int iterations,
+               double *elapsed) {
+  cl_int err;
+
+  // Set kernel arguments
+  err = clSetKernelArg(ctx->kernel, 0, sizeof(cl_mem), &buffers->d_in);
+  CHECK_CL_ERROR(err, "Error in setting kernel argument d_in");
+
+  err = clSetKernelArg(ctx->kernel, 1, sizeof(cl_mem), &buffers->d_out);
+  CHECK_CL_ERROR(err, "Error in setting kernel argument d_out");
+
+  const cl_uint stores = STORES_PER_ITEM;
+
+  err = clSetKernelArg(ctx->kernel, 2, sizeof(cl_uint), &stores);
+  CHECK_CL_ERROR(err, "Error in setting kernel argument stores");
+
+  const size_t global_size = GLOBAL_SIZE;
+  const size_t local_size = LOCAL_SIZE;
+
+  // Warm up once so that the first launch cost is not measured
+  err = clEnqueueNDRangeKernel(ctx->queue, ctx->kernel, 1, NULL, &global_size,
+                               &local_size, 0, NULL, NULL);
+  CHECK_CL_ERROR(err, "Error in enqueuing kernel");
+
+  err = clFinish(ctx->queue);
+  CHECK_CL_ERROR(err, "Error in finishing command queue");
+
+  const double start = now_seconds();
+
+  for (int i = 0; i < iterations; ++i) {
+    err = clEnqueueNDRangeKernel(ctx->queue, ctx->kernel, 1, NULL,
+                                 &global_size, &local_size, 0, NULL, NULL);
+    CHECK_CL_ERROR(err, "Error in enqueuing kernel");
+  }
+
+  err = clFinish(ctx->queue);
+  CHECK_CL_ERROR(err, "Error in finishing command queue");
+
+  *elapsed = now_seconds() - start;
+
+  return 0;
+}
+
+int main(const int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <path_to_spv_file> [iterations]\n", argv[0]);
+
+    return EXIT_FAILURE;
+  }
+
+  const char *path = argv[1];
+  const int iterations = argc >= 3 ? atoi(argv[2]) : 100;
+
+  if (iterations <= 0) {
+    fprintf(stderr, "Invalid iteration count: %s\n", argv[2]);
+
+    return EXIT_FAILURE;
+  }
+
+  OpenCLContext ctx = {0};
+
+  if (init_opencl_context(&ctx) != 0) {
+    fprintf(stderr, "OpenCL context initialization failed.\n");
+
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  if (load_spv_program(&ctx, path, "run") != 0) {
+    fprintf(stderr, "Cannot load SPIR-V program.\n");
+
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  if (init_sample_rate(&ctx) != 0) {
+    fprintf(stderr, "Failed to set sanitizer sample rate.\n");
+
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  ReportBuffer reports = {0};
+
+  if (init_report_buffer(&ctx, &reports) != 0) {
+    fprintf(stderr, "Failed to initialize sanitizer report buffer.\n");
+
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  ShadowSpill spill = {0};
+
+  if (init_shadow_spill(&ctx, &spill) != 0) {
+    fprintf(stderr, "Failed to initialize sanitizer shadow spill.\n");
+
+    clean_shadow_spill(&ctx, &spill);
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  // Too large for the stack
+  OpenCLBuffers *buffers = calloc(1, sizeof(OpenCLBuffers));
+
+  if (!buffers || init_opencl_buffers(&ctx, buffers) != 0) {
+    fprintf(stderr, "Failed to initialize OpenCL buffers.\n");
+
+    if (buffers) {
+      clean_opencl_buffers(buffers);
+      free(buffers);
+    }
+    clean_shadow_spill(&ctx, &spill);
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  double elapsed = 0.0;
+
+  if (run_kernel(&ctx, buffers, iterations, &elapsed) != 0) {
+    fprintf(stderr, "Kernel execution failed.\n");
+
+    clean_opencl_buffers(buffers);
+    free(buffers);
+    clean_shadow_spill(&ctx, &spill);
+    clean_report_buffer(&reports);
+    clean_opencl_context(&ctx);
+
+    return EXIT_FAILURE;
+  }
+
+  if (read_reports(&ctx, &reports) != 0) {
+    fprintf(stderr, "Failed to read sanitizer reports.\n");
+  }
+
+  const double stores =
+      (double)GLOBAL_SIZE * STORES_PER_ITEM * (double)iterations;
+
+  printf("Iterations: %d\n", iterations);
+  printf("Elapsed: %.3f ms\n", elapsed * 1e3);
+  printf("Local accesses/s: %.3e\n", stores / elapsed);
+
+  clean_opencl_buffers(buffers);
+  free(buffers);
+  clean_shadow_spill(&ctx, &spill);
+  clean_report_buffer(&reports);
+  clean_opencl_context(&ctx);
+
+  return EXIT_SUCCESS;
+}
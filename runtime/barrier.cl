@@ -0,0 +1,82 @@
+#include "libscsan.h"
+
+// Barrier arrival counting. Every work-item takes a ticket from the
+// work-group arrival count before a checked barrier. When the whole group
+// reaches the barrier, the tickets of the n-th one are [n * size,
+// (n + 1) * size), and after it everyone sees at least (n + 1) * size
+// arrivals: the next barrier cannot complete before they all read the count.
+// Fewer arrivals mean that the hardware released the barrier although some
+// work-items skipped it or wait at another one.
+
+// The count goes back to 0 at the end of the barrier that reaches this many
+// arrivals (rounded down to a multiple of the group size), so it never wraps
+#define LIBSCSAN_BARRIER_ARRIVAL_LIMIT 0x80000000u
+
+static uint libscsan_barrier_group_size(void) {
+  return get_local_size(0) * get_local_size(1) * get_local_size(2);
+}
+
+static uint libscsan_barrier_wrap(uint size) {
+  return LIBSCSAN_BARRIER_ARRIVAL_LIMIT / size * size;
+}
+
+// Called by every work-item at kernel entry when a checked barrier may
+// follow. Without sync, a barrier of the kernel that comes before every
+// checked one publishes the reset.
+void libscsan_barrier_enter(local uint *arrivals, uint sync) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_BARRIERS)) {
+    return;
+  }
+
+  if (get_local_linear_id() == 0) {
+    atomic_store_explicit((volatile local atomic_uint *)arrivals, 0, memory_order_relaxed, memory_scope_work_group);
+  }
+
+  if (sync) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+// Called right before a checked barrier. Returns the ticket for
+// libscsan_barrier_check.
+uint libscsan_barrier_arrive(local uint *arrivals) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_BARRIERS)) {
+    return 0;
+  }
+
+  volatile local atomic_uint *count = (volatile local atomic_uint *)arrivals;
+  uint ticket = atomic_fetch_add_explicit(count, 1, memory_order_relaxed, memory_scope_work_group);
+
+  // The last arrival at the wrap point: nobody else touches the count until
+  // the barrier releases
+  if (ticket >= LIBSCSAN_BARRIER_ARRIVAL_LIMIT / 2) {
+    if (ticket + 1 == libscsan_barrier_wrap(libscsan_barrier_group_size())) {
+      atomic_store_explicit(count, 0, memory_order_relaxed, memory_scope_work_group);
+    }
+  }
+
+  return ticket;
+}
+
+// Called right after a checked barrier
+void libscsan_barrier_check(local uint *arrivals, uint ticket, uint site) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_BARRIERS)) {
+    return;
+  }
+
+  uint size = libscsan_barrier_group_size();
+  uint first = ticket - ticket % size;
+  uint done = first + size;
+  uint seen = atomic_load_explicit((volatile local atomic_uint *)arrivals, memory_order_relaxed, memory_scope_work_group);
+
+  if (seen >= done) {
+    return;
+  }
+
+  // Wrapped: what is left are arrivals at the next barrier
+  if (done == libscsan_barrier_wrap(size) && seen < size) {
+    return;
+  }
+
+  libscsan_report_divergent_barrier(site, seen - first);
+}
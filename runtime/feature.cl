@@ -0,0 +1,22 @@
+#include "libscsan.h"
+
+int __attribute__((overloadable)) __spirv_SpecConstant(int spec_id, int default_value);
+
+// Whether a sanitizer feature is on. The answer is a specialization constant,
+// so the driver folds the checks of disabled features away.
+uint libscsan_feature_enabled(uint feature) {
+  switch (feature) {
+  case LIBSCSAN_FEATURE_BOUNDS:
+    return __spirv_SpecConstant(LIBSCSAN_SPEC_ID_BASE + LIBSCSAN_FEATURE_BOUNDS, 1) != 0;
+  case LIBSCSAN_FEATURE_LOCAL_RACES:
+    return __spirv_SpecConstant(LIBSCSAN_SPEC_ID_BASE + LIBSCSAN_FEATURE_LOCAL_RACES, 1) != 0;
+  case LIBSCSAN_FEATURE_REPORTING:
+    return __spirv_SpecConstant(LIBSCSAN_SPEC_ID_BASE + LIBSCSAN_FEATURE_REPORTING, 1) != 0;
+  case LIBSCSAN_FEATURE_BARRIERS:
+    return __spirv_SpecConstant(LIBSCSAN_SPEC_ID_BASE + LIBSCSAN_FEATURE_BARRIERS, 1) != 0;
+  case LIBSCSAN_FEATURE_GLOBAL_RACES:
+    return __spirv_SpecConstant(LIBSCSAN_SPEC_ID_BASE + LIBSCSAN_FEATURE_GLOBAL_RACES, 1) != 0;
+  default:
+    return 1;
+  }
+}
@@ -0,0 +1,196 @@
+#include "libscsan.h"
+
+// Write-write races on global memory between work-items of one dispatch.
+// Each written granule gets a slot of the host-allocated table; a write to a
+// granule whose slot names another writer in the current epoch conflicts,
+// unless both belong to one work-group and a barrier fencing global memory
+// separates them. Slots of earlier epochs are stale and reused for any
+// granule, so the table only has to hold the granules written by one
+// dispatch.
+
+#ifdef LIBSCSAN_GLOBAL_RACES
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+
+global atomic_ulong *libscsan_global_shadow_table;
+global uint libscsan_global_shadow_mask;
+global uint libscsan_global_shadow_epoch;
+
+// Writes that found no slot within LIBSCSAN_GLOBAL_SHADOW_PROBES
+global atomic_uint libscsan_global_shadow_dropped;
+
+// Called by the host with a single work-item before each dispatch. Returns
+// the writes the previous dispatch could not record.
+kernel void libscsan_set_global_shadow(global atomic_ulong *table, uint mask,
+                                       uint epoch, global uint *dropped) {
+  libscsan_global_shadow_table = table;
+  libscsan_global_shadow_mask = mask;
+  libscsan_global_shadow_epoch = epoch;
+
+  *dropped = atomic_exchange_explicit(&libscsan_global_shadow_dropped, 0,
+                                      memory_order_relaxed,
+                                      memory_scope_device);
+}
+
+static uint libscsan_global_slot_epoch(ulong slot) {
+  return (uint)(slot >> 32) & LIBSCSAN_GLOBAL_SHADOW_MAX_EPOCH;
+}
+
+static uint libscsan_global_slot_phase(ulong slot) {
+  return (uint)(slot >> 24) & LIBSCSAN_GLOBAL_SHADOW_MAX_PHASE;
+}
+
+// Compare a write with the slot of its granule. Returns 0 when the slot
+// changed in the meantime and the write has to look it up again.
+static uint libscsan_global_compare(global atomic_ulong *slot, ulong seen,
+                                    ulong mine, uint site) {
+  uint local_mask = (1u << LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS) - 1;
+  uint writer = (uint)seen & LIBSCSAN_GLOBAL_SHADOW_WRITER_MASK;
+  uint me = (uint)mine & LIBSCSAN_GLOBAL_SHADOW_WRITER_MASK;
+  uint group = writer >> LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS;
+
+  if (group != me >> LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS) {
+    libscsan_report_global_memory_conflict(site, group, writer & local_mask);
+
+    return 1;
+  }
+
+  if (libscsan_global_slot_phase(seen) == libscsan_global_slot_phase(mine)) {
+    if (writer != me) {
+      libscsan_report_global_memory_conflict(site, group, writer & local_mask);
+    }
+
+    return 1;
+  }
+
+  // A barrier of the work-group orders the recorded write before this one.
+  // The slot moves on to this phase, so the group's later writes compare
+  // against this one.
+  return atomic_compare_exchange_strong_explicit(slot, &seen, mine, memory_order_relaxed, memory_order_relaxed, memory_scope_device);
+}
+
+static void libscsan_global_record(global atomic_ulong *table, uint mask,
+                                   uint epoch, ulong granule,
+                                   uint granule_shift, uint me, uint phase,
+                                   uint site) {
+  // The low bits pick the slot, the high bits are the key kept in it.
+  // Stores narrower than the granularity use smaller granules, so the size
+  // is part of the key.
+  ulong hash = (granule << 6 | granule_shift) * 0x9e3779b97f4a7c15ul;
+
+  hash ^= hash >> 31;
+  hash *= 0xbf58476d1ce4e5b9ul;
+  hash ^= hash >> 29;
+
+  uint key = (uint)(hash >> 40);
+
+  key += key == 0; // 0 marks an empty slot
+
+  ulong mine = (ulong)key << 40 | (ulong)epoch << 32 | (ulong)phase << 24 | me;
+  uint start = (uint)hash & mask;
+
+  // Writers of one granule all claim the first free slot of its probe
+  // sequence, so only one of them wins it. A slot of the current epoch only
+  // changes again to a later phase of its work-group, so the retries end
+  // once the group's writes of this phase are in.
+  for (;;) {
+    global atomic_ulong *free = 0;
+    ulong free_seen = 0;
+    uint retry = 0;
+
+    for (uint probe = 0; probe < LIBSCSAN_GLOBAL_SHADOW_PROBES; ++probe) {
+      global atomic_ulong *slot = &table[(start + probe) & mask];
+      ulong seen = atomic_load_explicit(slot, memory_order_relaxed, memory_scope_device);
+
+      if ((uint)(seen >> 40) == key && libscsan_global_slot_epoch(seen) == epoch) {
+        if (libscsan_global_compare(slot, seen, mine, site)) {
+          return;
+        }
+
+        retry = 1;
+
+        break;
+      }
+
+      // Empty, or written by an earlier dispatch
+      if (!free && (seen == 0 || libscsan_global_slot_epoch(seen) != epoch)) {
+        free = slot;
+        free_seen = seen;
+      }
+    }
+
+    if (retry) {
+      continue;
+    }
+
+    if (!free) {
+      atomic_fetch_add_explicit(&libscsan_global_shadow_dropped, 1, memory_order_relaxed, memory_scope_device);
+
+      return;
+    }
+
+    if (atomic_compare_exchange_strong_explicit(free, &free_seen, mine, memory_order_relaxed, memory_order_relaxed, memory_scope_device)) {
+      return;
+    }
+
+    // Taken by another write in the meantime, possibly of this granule
+  }
+}
+#endif
+
+// Called by every work-item at kernel entry. Local memory holds leftovers of
+// earlier work-groups, so the phase starts over explicitly.
+void libscsan_global_enter(local uchar *phases) {
+#ifdef LIBSCSAN_GLOBAL_RACES
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_GLOBAL_RACES)) {
+    return;
+  }
+
+  phases[get_local_linear_id()] = 0;
+#endif
+}
+
+// Called by every work-item after a barrier that fences global memory. The
+// phase wraps around at LIBSCSAN_GLOBAL_SHADOW_MAX_PHASE.
+void libscsan_global_barrier(local uchar *phases) {
+#ifdef LIBSCSAN_GLOBAL_RACES
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_GLOBAL_RACES)) {
+    return;
+  }
+
+  ++phases[get_local_linear_id()];
+#endif
+}
+
+// Record a write of size bytes at addr, checked per 1 << granule_shift bytes
+void libscsan_global_write(global void *addr, uint size, uint granule_shift,
+                           uint site, local uchar *phases) {
+#ifdef LIBSCSAN_GLOBAL_RACES
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_GLOBAL_RACES)) {
+    return;
+  }
+
+  global atomic_ulong *table = libscsan_global_shadow_table;
+  uint epoch = libscsan_global_shadow_epoch;
+
+  if (!table || !epoch) {
+    return;
+  }
+
+  uint mask = libscsan_global_shadow_mask;
+  size_t lid = get_local_linear_id();
+  size_t group = get_group_id(0) +
+                 get_num_groups(0) * (get_group_id(1) +
+                                      get_num_groups(1) * get_group_id(2));
+  uint me = (uint)(group % (1u << LIBSCSAN_GLOBAL_SHADOW_GROUP_BITS))
+                << LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS |
+            (uint)(lid % (1u << LIBSCSAN_GLOBAL_SHADOW_LOCAL_BITS));
+  ulong first = (ulong)addr >> granule_shift;
+  ulong last = ((ulong)addr + max(size, 1u) - 1) >> granule_shift;
+
+  for (ulong granule = first; granule <= last; ++granule) {
+    libscsan_global_record(table, mask, epoch, granule, granule_shift, me,
+                           phases[lid], site);
+  }
+#endif
+}
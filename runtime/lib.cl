@@ -1,2 +1,6 @@
+#include "feature.cl"
 #include "report.cl"
 #include "shadow.cl"
+#include "barrier.cl"
+#include "global.cl"
+#include "sample.cl"
@@ -1,3 +1,5 @@
+#include "libscsan.h"
+
 // ANSI colors
 #define RESET "\033[0m"
 #define RED "\033[31m"
@@ -5,16 +7,182 @@
 #define BLUE "\033[34m"
 #define BOLD "\033[1m"
 
-void libscsan_report_index_out_of_bounds() {
+// Report buffer used when built with LIBSCSAN_REPORT_RING. The host copies
+// it out with libscsan_read_reports after the kernel finished. The head
+// keeps counting past the capacity, so the host knows how many were dropped.
+global atomic_uint libscsan_report_head;
+global libscsan_report_record libscsan_report_records[LIBSCSAN_REPORT_CAPACITY];
+
+// Number of failed checks per site, including the ones not reported
+global atomic_uint libscsan_site_counts[LIBSCSAN_MAX_SITES];
+
+// Set by the first failed check of kernels built with -scsan-on-error=abort,
+// until the host reads the reports
+global atomic_uint libscsan_poisoned;
+
+void libscsan_poison(void) {
+  atomic_store_explicit(&libscsan_poisoned, 1, memory_order_relaxed,
+                        memory_scope_device);
+}
+
+// Polled by the same kernels at function entries and loop back-edges
+uint libscsan_is_poisoned(void) {
+  return atomic_load_explicit(&libscsan_poisoned, memory_order_relaxed,
+                              memory_scope_device);
+}
+
+// Polled at kernel entry. Every work-item of the group gets the same answer,
+// so none of them waits at a barrier for the ones that left.
+uint libscsan_is_poisoned_work_group(void) {
+#ifdef __opencl_c_work_group_collective_functions
+  return work_group_any(libscsan_is_poisoned());
+#else
+  return libscsan_is_poisoned();
+#endif
+}
+
+// Count the failure and tell whether it is among the first ones of its site
+static bool libscsan_should_report(uint site) {
+  uint count = atomic_fetch_add_explicit(
+      &libscsan_site_counts[site % LIBSCSAN_MAX_SITES], 1, memory_order_relaxed,
+      memory_scope_device);
+
+  return count < LIBSCSAN_REPORTS_PER_SITE;
+}
+
+static void libscsan_push_report(uint kind, uint site, ulong conflict_id) {
+  uint slot = atomic_fetch_add_explicit(&libscsan_report_head, 1,
+                                        memory_order_relaxed,
+                                        memory_scope_device);
+
+  // Once full, drop the record instead of wrapping around: a slot written
+  // field by field by two work-items would mix both records
+  if (slot >= LIBSCSAN_REPORT_CAPACITY) {
+    return;
+  }
+
+  global libscsan_report_record *record = &libscsan_report_records[slot];
+
+  record->kind = kind;
+  record->site = site;
+  record->conflict_id = conflict_id;
+
+  for (uint dim = 0; dim < 3; ++dim) {
+    record->global_id[dim] = get_global_id(dim);
+    record->local_id[dim] = get_local_id(dim);
+  }
+}
+
+kernel void libscsan_read_reports(global libscsan_report_record *records,
+                                  global uint *count,
+                                  global uint *site_counts,
+                                  global uint *poisoned) {
+  uint head = atomic_load_explicit(&libscsan_report_head, memory_order_relaxed,
+                                   memory_scope_device);
+  uint size = min(head, (uint)LIBSCSAN_REPORT_CAPACITY);
+
+  for (uint i = 0; i < size; ++i) {
+    records[i] = libscsan_report_records[i];
+  }
+
+  *count = head;
+
+  atomic_store_explicit(&libscsan_report_head, 0, memory_order_relaxed,
+                        memory_scope_device);
+
+  for (uint site = 0; site < LIBSCSAN_MAX_SITES; ++site) {
+    site_counts[site] =
+        atomic_exchange_explicit(&libscsan_site_counts[site], 0,
+                                 memory_order_relaxed, memory_scope_device);
+  }
+
+  *poisoned = atomic_exchange_explicit(&libscsan_poisoned, 0,
+                                       memory_order_relaxed,
+                                       memory_scope_device);
+}
+
+void libscsan_report_index_out_of_bounds(uint site) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_REPORTING)) {
+    return;
+  }
+
+  if (!libscsan_should_report(site)) {
+    return;
+  }
+
+#ifdef LIBSCSAN_REPORT_RING
+  libscsan_push_report(LIBSCSAN_REPORT_INDEX_OUT_OF_BOUNDS, site, 0);
+#else
   size_t gid = get_global_id(0);
-  size_t lid = get_local_id(0);
+  size_t lid = get_local_linear_id();
 
-  printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ") Array index out of bounds\n", gid, lid);
+  printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ", Site #" YELLOW "%u" RESET ") Array index out of bounds\n", gid, lid, site);
+#endif
 }
 
-void libscsan_report_local_memory_conflict(unsigned long prev_gid) {
+// The previous writer's work-group and local linear ids, folded as in the
+// shadow table slot
+void libscsan_report_global_memory_conflict(uint site, uint prev_group,
+                                            uint prev_lid) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_REPORTING)) {
+    return;
+  }
+
+  if (!libscsan_should_report(site)) {
+    return;
+  }
+
+#ifdef LIBSCSAN_REPORT_RING
+  libscsan_push_report(LIBSCSAN_REPORT_GLOBAL_MEMORY_CONFLICT, site,
+                       (ulong)prev_group << 32 | prev_lid);
+#else
+  size_t gid = get_global_id(0);
+  size_t lid = get_local_linear_id();
+
+  printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ", Site #" YELLOW "%u" RESET ") Global memory conflict detected (Previously written by Local #" YELLOW "%u" RESET " of Group #" YELLOW "%u" RESET ")\n", gid, lid, site, prev_lid, prev_group);
+#endif
+}
+
+// arrived is the number of work-items of the group that reached the barrier
+void libscsan_report_divergent_barrier(uint site, unsigned long arrived) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_REPORTING)) {
+    return;
+  }
+
+  if (!libscsan_should_report(site)) {
+    return;
+  }
+
+#ifdef LIBSCSAN_REPORT_RING
+  libscsan_push_report(LIBSCSAN_REPORT_DIVERGENT_BARRIER, site, arrived);
+#else
+  size_t gid = get_global_id(0);
+  size_t lid = get_local_linear_id();
+
+  printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ", Site #" YELLOW "%u" RESET ") Barrier reached by only " YELLOW "%lu" RESET " work-items of the work-group\n", gid, lid, site, arrived);
+#endif
+}
+
+// prev_lid is all ones when the cell was read by several work-items
+void libscsan_report_local_memory_conflict(uint site, unsigned long prev_lid) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_REPORTING)) {
+    return;
+  }
+
+  if (!libscsan_should_report(site)) {
+    return;
+  }
+
+#ifdef LIBSCSAN_REPORT_RING
+  libscsan_push_report(LIBSCSAN_REPORT_LOCAL_MEMORY_CONFLICT, site, prev_lid);
+#else
   size_t gid = get_global_id(0);
-  size_t lid = get_local_id(0);
+  size_t lid = get_local_linear_id();
 
-  printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ") Local memory conflict detected (Previously wrote by #" YELLOW "%zu" RESET ")\n", gid, lid, prev_gid);
+  if (prev_lid == LIBSCSAN_CONFLICT_SHARED_READERS) {
+    printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ", Site #" YELLOW "%u" RESET ") Local memory conflict detected (Previously read by several work-items)\n", gid, lid, site);
+  } else {
+    printf("\n" BLUE BOLD "===============================================================================\n" RESET BLUE "[ComputeSanitizer] " RED "error" RESET ": (Global #" YELLOW "%zu" RESET ", Local #" YELLOW "%zu" RESET ", Site #" YELLOW "%u" RESET ") Local memory conflict detected (Previously accessed by Local #" YELLOW "%lu" RESET ")\n", gid, lid, site, prev_lid);
+  }
+#endif
 }
@@ -0,0 +1,22 @@
+#include "libscsan.h"
+
+// Work-groups out of LIBSCSAN_SAMPLE_SCALE that run the checked kernel
+global uint libscsan_sample_rate = LIBSCSAN_SAMPLE_RATE;
+
+kernel void libscsan_set_sample_rate(uint rate) {
+  libscsan_sample_rate = min(rate, (uint)LIBSCSAN_SAMPLE_SCALE);
+}
+
+// Returns 1 when this work-group is checked. Every work-item of the group
+// gets the same answer.
+uint libscsan_sample_work_group(void) {
+  uint h = (uint)get_group_id(0) * 0x9e3779b1u;
+
+  h ^= (uint)get_group_id(1) * 0x85ebca77u;
+  h ^= (uint)get_group_id(2) * 0xc2b2ae3du;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+
+  return (h % LIBSCSAN_SAMPLE_SCALE) < libscsan_sample_rate;
+}
@@ -1,8 +1,304 @@
-void libscsan_shadow_memset(local unsigned long *shadow, unsigned long size, unsigned long value) {
-  size_t lid = get_local_id(0);
-  size_t local_size = get_local_size(0);
+#include "libscsan.h"
 
-  for (size_t i = lid; i < size; i += local_size) {
-    shadow[i] = value;
+// Shadow cells are [epoch | read | owner], where owner is the local linear
+// id + 1 of the work-item that accessed the cell in that barrier epoch. Cells
+// whose epoch differs from the current one are stale and count as clear, so
+// after the clear at kernel entry the shadows only need another one when the
+// epoch wraps.
+//
+// The entry clear cannot be skipped by starting the work-group at an epoch
+// the cells do not hold. Local memory is not ours between work-groups: an
+// earlier work-group or another kernel may have left any bits in it, and
+// with at most a few epoch bits a leftover cell matches a fresh epoch often
+// enough to report races that never happened. Only the clear rules that out.
+
+// Called by every work-item at kernel entry, before the shadows are cleared.
+void libscsan_shadow_enter(local uchar *epochs) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return;
+  }
+
+  epochs[get_local_linear_id()] = 1;
+}
+
+// Called by every work-item after a barrier. Returns 1 when the epoch wrapped.
+uint libscsan_shadow_barrier(local uchar *epochs, uint epoch_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return 0;
+  }
+
+  size_t lid = get_local_linear_id();
+  uint limit = (1u << epoch_bits) - 1;
+  uint epoch = epochs[lid] + 1;
+  uint fresh = epoch > limit;
+
+  if (fresh) {
+    epoch = 1;
+  }
+
+  epochs[lid] = epoch;
+
+  return fresh;
+}
+
+void libscsan_shadow_reset(local uint *shadow, unsigned long words, uint fresh) {
+  if (!fresh) {
+    return;
+  }
+
+  size_t lid = get_local_linear_id();
+  size_t local_size = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+  for (size_t i = lid; i < words; i += local_size) {
+    shadow[i] = 0;
+  }
+}
+
+// Spilled shadows are cleared through global memory, so fence both
+void libscsan_shadow_sync(uint fresh) {
+  if (fresh) {
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+  }
+}
+
+// Next state of a shadow cell holding `seen` after the access `value`
+// ([epoch | read | owner]). Returns the owner the access conflicts with, or 0
+// with the new state in *next. Within an epoch a cell is written by one
+// work-item, or read by one work-item, or read by several (owner all ones).
+static uint libscsan_shadow_next(uint seen, uint value, uint owner_bits, uint *next) {
+  uint owner_mask = (1u << owner_bits) - 1;
+  uint read_bit = 1u << owner_bits;
+  uint epoch_mask = ~(owner_mask | read_bit);
+  uint owner = seen & owner_mask;
+  uint me = value & owner_mask;
+
+  *next = seen;
+
+  if ((seen & epoch_mask) != (value & epoch_mask)) {
+    // Stale: left over from an earlier epoch
+    *next = value;
+
+    return 0;
+  }
+
+  if (!(seen & read_bit)) {
+    // Written: only the writer may access it again
+    return owner == me ? 0 : owner;
   }
+
+  if (value & read_bit) {
+    // Read after read: become shared once a second reader shows up
+    if (owner != me && owner != owner_mask) {
+      *next = seen | owner_mask;
+    }
+
+    return 0;
+  }
+
+  // Write after read: only the sole reader may upgrade it
+  if (owner != me) {
+    return owner;
+  }
+
+  *next = value;
+
+  return 0;
+}
+
+// The accessors below work on generic pointers: the shadows stay in local
+// memory unless the compiler spilled them to a global slice. Either way only
+// the owning work-group touches them, hence the work-group scope.
+
+// Record an access in a shadow cell. Returns 0, or the conflicting owner.
+static uint libscsan_shadow_claim(volatile atomic_uint *word, uint value, uint owner_bits) {
+  uint seen = atomic_load_explicit(word, memory_order_relaxed, memory_scope_work_group);
+
+  for (;;) {
+    uint next;
+    uint owner = libscsan_shadow_next(seen, value, owner_bits, &next);
+
+    if (owner || next == seen) {
+      return owner;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(word, &seen, next, memory_order_relaxed, memory_order_relaxed, memory_scope_work_group)) {
+      return 0;
+    }
+  }
+}
+
+// OpenCL has no 16-bit atomics: update the half of the containing 32-bit word.
+static ushort libscsan_shadow_claim_half(ushort *cell, ushort value, uint owner_bits) {
+  volatile atomic_uint *word = (volatile atomic_uint *)((uintptr_t)cell & ~(uintptr_t)3);
+  uint shift = ((uintptr_t)cell & 2) * 8;
+  uint half = 0xffffu << shift;
+  uint seen = atomic_load_explicit(word, memory_order_relaxed, memory_scope_work_group);
+
+  for (;;) {
+    uint cur = (seen & half) >> shift;
+    uint next;
+    uint owner = libscsan_shadow_next(cur, value, owner_bits, &next);
+
+    if (owner || next == cur) {
+      return (ushort)owner;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(word, &seen, (seen & ~half) | (next << shift), memory_order_relaxed, memory_order_relaxed, memory_scope_work_group)) {
+      return 0;
+    }
+  }
+}
+
+// Record a store to a cell no other work-item stores to in this epoch (the
+// index is injective in the local id). Same result as libscsan_shadow_claim,
+// with one exchange in place of the compare-exchange loop: a store always
+// leaves its own value in the cell, or conflicts, so only the old state is
+// needed. A read of another work-item either lands before the exchange and
+// is returned by it, or after it and sees this store.
+static uint libscsan_shadow_stamp(volatile atomic_uint *word, uint value, uint owner_bits) {
+  uint seen = atomic_exchange_explicit(word, value, memory_order_relaxed, memory_scope_work_group);
+  uint next;
+
+  return libscsan_shadow_next(seen, value, owner_bits, &next);
+}
+
+// A 16-bit exchange would race with the compare-exchange of the other half
+// on the containing word, so a 16-bit stamp is a claim after all. The pass
+// gives arrays with such stores 32-bit cells.
+static ushort libscsan_shadow_stamp_half(ushort *cell, ushort value, uint owner_bits) {
+  return libscsan_shadow_claim_half(cell, value, owner_bits);
+}
+
+uint libscsan_shadow_claim_u32(local uint *cell, uint value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return 0;
+  }
+
+  return libscsan_shadow_claim((volatile atomic_uint *)cell, value, owner_bits);
+}
+
+ushort libscsan_shadow_claim_u16(local ushort *cell, ushort value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return 0;
+  }
+
+  return libscsan_shadow_claim_half((ushort *)cell, value, owner_bits);
+}
+
+uint libscsan_shadow_stamp_u32(local uint *cell, uint value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return 0;
+  }
+
+  return libscsan_shadow_stamp((volatile atomic_uint *)cell, value, owner_bits);
+}
+
+ushort libscsan_shadow_stamp_u16(local ushort *cell, ushort value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES)) {
+    return 0;
+  }
+
+  return libscsan_shadow_stamp_half((ushort *)cell, value, owner_bits);
+}
+
+// Spilled shadows. The buffer is only reachable through program scope
+// variables, so runtimes without them leave spilled shadows unchecked.
+#ifdef __opencl_c_program_scope_global_variables
+global uchar *libscsan_shadow_spill_base;
+global ulong libscsan_shadow_spill_capacity;
+
+// Work-groups of the last dispatch and slice size they needed, for the host
+// to size the buffer
+global atomic_uint libscsan_shadow_spill_groups;
+global uint libscsan_shadow_spill_slice_bytes;
+
+// Called by the host with a single work-item before each dispatch. Returns
+// what the previous dispatch needed in needed[0] (work-groups) and needed[1]
+// (bytes per work-group).
+kernel void libscsan_set_shadow_spill(global uchar *base, ulong capacity,
+                                      global uint *needed) {
+  libscsan_shadow_spill_base = base;
+  libscsan_shadow_spill_capacity = capacity;
+
+  needed[0] = atomic_exchange_explicit(&libscsan_shadow_spill_groups, 0,
+                                       memory_order_relaxed,
+                                       memory_scope_device);
+  needed[1] = libscsan_shadow_spill_slice_bytes;
+}
+
+static bool libscsan_shadow_spilled(global void *shadow) {
+  return (ulong)((global uchar *)shadow - libscsan_shadow_spill_base) < libscsan_shadow_spill_capacity;
+}
+#else
+static bool libscsan_shadow_spilled(global void *shadow) {
+  return false;
+}
+#endif
+
+// Slice of bytes for the work-group. Outside the buffer when it is too small,
+// which turns the global accessors into no-ops.
+global uchar *libscsan_shadow_spill_slice(ulong bytes) {
+#ifdef __opencl_c_program_scope_global_variables
+  ulong group = get_group_id(0) + get_num_groups(0) * (get_group_id(1) + get_num_groups(1) * get_group_id(2));
+
+  if (get_local_linear_id() == 0) {
+    atomic_fetch_max_explicit(&libscsan_shadow_spill_groups, (uint)group + 1, memory_order_relaxed, memory_scope_device);
+    libscsan_shadow_spill_slice_bytes = (uint)bytes;
+  }
+
+  if (libscsan_shadow_spill_base && (group + 1) * bytes <= libscsan_shadow_spill_capacity) {
+    return libscsan_shadow_spill_base + group * bytes;
+  }
+
+  return libscsan_shadow_spill_base + libscsan_shadow_spill_capacity;
+#else
+  return 0;
+#endif
+}
+
+// The slice was left behind by another work-group of an earlier dispatch, so
+// it is cleared at entry whatever the launch header says
+void libscsan_shadow_reset_global(global uint *shadow, unsigned long words, uint fresh) {
+  if (!fresh || !libscsan_shadow_spilled(shadow)) {
+    return;
+  }
+
+  size_t lid = get_local_linear_id();
+  size_t local_size = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+  for (size_t i = lid; i < words; i += local_size) {
+    shadow[i] = 0;
+  }
+}
+
+uint libscsan_shadow_claim_global_u32(global uint *cell, uint value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES) || !libscsan_shadow_spilled(cell)) {
+    return 0;
+  }
+
+  return libscsan_shadow_claim((volatile atomic_uint *)cell, value, owner_bits);
+}
+
+ushort libscsan_shadow_claim_global_u16(global ushort *cell, ushort value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES) || !libscsan_shadow_spilled(cell)) {
+    return 0;
+  }
+
+  return libscsan_shadow_claim_half((ushort *)cell, value, owner_bits);
+}
+
+uint libscsan_shadow_stamp_global_u32(global uint *cell, uint value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES) || !libscsan_shadow_spilled(cell)) {
+    return 0;
+  }
+
+  return libscsan_shadow_stamp((volatile atomic_uint *)cell, value, owner_bits);
+}
+
+ushort libscsan_shadow_stamp_global_u16(global ushort *cell, ushort value, uint owner_bits) {
+  if (!libscsan_feature_enabled(LIBSCSAN_FEATURE_LOCAL_RACES) || !libscsan_shadow_spilled(cell)) {
+    return 0;
+  }
+
+  return libscsan_shadow_stamp_half((ushort *)cell, value, owner_bits);
 }